@@ -1,8 +1,77 @@
 #pragma once
 
+#include <array>
+#include <algorithm>
+#include <limits>
+#include <vector>
+
 #include "headers/Matrix.h"
+#include "headers/SIMDKernels.h"
+#include "headers/TiledMatrix.h"
+#include "headers/Half.h"
+#include "headers/Reduction.h"
+#include "headers/Workspace.h"
+#include "Metrics.h"
+#include "KDTree.h"
+
+/**
+ * Assignment engines available to map each sample to its closest centroid
+ *      LLOYD: all pairs (sample, centroid) distances computed at each call
+ *      ELKAN: triangle inequality bounds (N*K lower bounds) skip most distances.
+ *             The samples kept by Hamerly's bound cost O(1), the others filter their K
+ *             bounds at once (simd::filter). With SquaredL2 it pays off with many features:
+ *             1.7x faster than LLOYD over 10 iterations with 128 features and K = 64 or 256,
+ *             1.3-1.5x per call after the first with 32 features and K = 64 or 256 (the first
+ *             call allocates the N*K bounds and costs 3-5 LLOYD calls). Overlapping clusters
+ *             keep more samples in the filter (128 features, K = 64: slightly behind LLOYD).
+ *             Not for low dimensional data: 3 features, K = 30 is ~9x slower than LLOYD,
+ *             the bounds rows cost more memory traffic than the SIMD scan
+ *      HAMERLY: one upper and one lower bound per sample, O(N) extra memory. The samples
+ *               left by the bounds are scanned by chunks (simd::assignTwo). With SquaredL2:
+ *               1.5x faster than LLOYD per call with 32 features, K = 256 and separated
+ *               clusters, on par with overlapping ones or 16 features, K = 100. Behind it
+ *               on low dimensional data (~1.7x slower with 3 features, K = 30)
+ *      YINYANG: centroids are grouped (at most 32 groups) and whole groups are filtered
+ *               with one lower bound per (sample, group). The groups left are scanned by
+ *               chunks of samples (simd::assignTwo per group). With SquaredL2 and 16 features:
+ *               ~1.8x faster than LLOYD per call with K = 4000 (M = 100000, 20 calls) and 2.3x
+ *               with K = 10000 (M = 40000), the first call costs ~1.3 LLOYD calls. Behind it
+ *               below about K = 1000 (on par with K = 1000, 2x slower with K = 200)
+ *               Full scans of these bound engines (first call, Hamerly's rescans, Yinyang's
+ *               groups, centroids distances) use the SIMD kernels, the few distances picked
+ *               by the bounds are computed one by one. They pay off when dist is costly and
+ *               not vectorized (Cosine: ELKAN ~20x faster than LLOYD per call with N = 32,
+ *               K = 256)
+ *      GEMM: distances expanded with x.c products (e.g. ||x||^2 - 2x.c + ||c||^2), the
+ *            products computed by a register blocked FMA kernel. Near ties are decided with
+ *            dist itself: same mapping as LLOYD. Ahead of LLOYD from about N = 32 dimensions
+ *            with hundreds of clusters, behind it for small N or K.
+ *            Dot product based metrics only (SquaredL2, Cosine), LLOYD otherwise
+ *      KDTREE: filtering algorithm over a kd-tree of the samples built once (see KDTree.h).
+ *              Whole subtrees are assigned and accumulated at once, the labels stay in
+ *              the tree order until they are read. Pays off when most cells belong to a
+ *              single centroid: 3-4x faster than LLOYD per call with 3 features, M = 4000000
+ *              and K = 8 or 30 (the build costs ~30 LLOYD calls), 4x with 8 features and
+ *              separated clusters but 2.6x slower with overlapping ones.
+ *              SquaredL2 only (LLOYD otherwise)
+ *      FUSED: LLOYD assignment fused with the update statistics (clusters sums and
+ *             sizes, number of changed labels, inertia) in a single pass over the samples
+ *      BLOCKED: LLOYD by blocks of samples x blocks of centroids sized from the
+ *               L2/L1 caches, for K*N too big to stay in L1 (e.g. K=256, N=32)
+ *      APPROXIMATE: inverted file over the centroids, only the lists of the closest
+ *                   groups are scanned (see setApproximation), the mapping is not always
+ *                   the exact one. Ahead of LLOYD only with thousands of clusters (1.7x with
+ *                   K = 8000, N = 16 and 4 probes, still behind it with K = 2000). LLOYD is
+ *                   used while the probes cover every group (K < 25 with 4 probes)
+*/
+enum AssignEnum { LLOYD, ELKAN, HAMERLY, YINYANG, GEMM, KDTREE, FUSED, BLOCKED, APPROXIMATE };
 
-template<typename T>
+/**
+ * D: number of features if known at compile time. Every feature loop
+ * then has a constant trip count and gets fully unrolled.
+ * Metric: distance policy (see Metrics.h)
+*/
+template<typename T, int D = DYNAMIC_DIMS, typename Metric = SquaredL2<T>>
 class ClosestCentroids : public Matrix<int>{
 public:
 
@@ -21,35 +90,855 @@ public:
      * Dimensions:
      *      rows: 1 (2 if toggle feature activated)
      *      cols: n_samples
+     * data may have more columns: its first n_samples samples are mapped
     */
     ClosestCentroids& getClosest(const Matrix<T>& data, const Matrix<T>& cluster){
-        int n_dims = data.getRows();
+        const int n_dims = nDims(data);
+        const int stride = data.getCols();
+        assert(stride >= _cols);
         int n_clusters = cluster.getCols();
 
-        #pragma omp parallel for collapse(1) num_threads(_n_threads)
-        for(int i = 0; i < _cols; ++i){
-            T abs_sum = 0;
-            for(int d = 0; d < n_dims; ++d){
-                abs_sum += std::abs(data(d, i) - cluster(d, 0));
+        if constexpr(Metric::vectorized && (std::is_same<T, float>::value || std::is_same<T, double>::value)){
+            // vectorized across samples, runtime dispatched (headers/SIMDKernels.h)
+            int n_chunks = (_cols + _chunk_samples - 1) / _chunk_samples;
+            #pragma omp parallel for num_threads(_n_threads)
+            for(int chunk = 0; chunk < n_chunks; ++chunk){
+                const int from_i = chunk * _chunk_samples;
+                simd::assign<Metric::kernel, D>(data.begin()+from_i, stride, std::min(_chunk_samples, _cols-from_i),
+                                                cluster.begin(), n_clusters, n_dims, n_clusters,
+                                                _matrix.get()+from_i+_toggled_row*_cols, _distBuffer->begin()+from_i);
             }
-            _matrix[i+_toggled_row*_cols] = 0;
-            (*_distBuffer)(0, i) = abs_sum;
-            for(int c = 1; c < n_clusters; ++c){
-                abs_sum = 0;
+        } else {
+            #pragma omp parallel for collapse(1) num_threads(_n_threads)
+            for(int i = 0; i < _cols; ++i){
+                T min_dist = Metric::template dist<D>(data.begin()+i, stride, cluster.begin(), n_clusters, n_dims);
+                int k_index = 0;
+                for(int c = 1; c < n_clusters; ++c){
+                    T dist = Metric::template dist<D>(data.begin()+i, stride, cluster.begin()+c, n_clusters, n_dims);
+                    if(dist < min_dist){
+                        k_index = c;
+                        min_dist = dist;
+                    }
+                }
+                _matrix[i+_toggled_row*_cols] = k_index;
+                (*_distBuffer)(0, i) = min_dist;
+            }
+        }
+        _current_row = _toggled_row;
+        _toggled_row ^= _toggle;
+        return *this;
+    }
+
+    /**
+     * getClosest fused with the statistics of the update step: while a chunk of samples
+     * is still in cache, its clusters sums (sums[c+d*K]) and sizes, the number of samples
+     * whose label changed and the inertia (sum of the Metric::dist to the closest centroid)
+     * are accumulated. The chunks are grouped in parts that only depend on M, each with
+     * its own accumulators reduced in a fixed order (same results for any number of threads).
+     * changed is M if the previous mapping isn't kept (unbuffered).
+    */
+    ClosestCentroids& getClosestFused(const Matrix<T>& data, const Matrix<T>& cluster, T* sums, int* counts, int& changed, double& inertia){
+        const int n_dims = nDims(data);
+        int n_clusters = cluster.getCols();
+        const int n_parts = reduction::partsN(_cols, _chunk_samples, 4*n_clusters);
+        const size_t sums_size = static_cast<size_t>(n_clusters) * n_dims;
+        _workspace.reset();
+        T* part_sums = _workspace.allocZero<T>(n_parts * sums_size);
+        int* part_counts = _workspace.allocZero<int>(static_cast<size_t>(n_parts) * n_clusters);
+        int* part_changed = _workspace.allocZero<int>(n_parts);
+        double* part_inertia = _workspace.allocZero<double>(n_parts);
+
+        #pragma omp parallel for schedule(dynamic) num_threads(_n_threads)
+        for(int part = 0; part < n_parts; ++part){
+            T* local_sums = part_sums + part*sums_size;
+            int* local_counts = part_counts + static_cast<size_t>(part)*n_clusters;
+            const int to_part = reduction::partBegin(part+1, n_parts, _cols, _chunk_samples);
+            for(int from_i = reduction::partBegin(part, n_parts, _cols, _chunk_samples); from_i < to_part; from_i += _chunk_samples){
+                const int n_samples = std::min(_chunk_samples, to_part - from_i);
+                int* labels = _matrix.get()+from_i+_toggled_row*_cols;
+                // other row (as getModifRate, _current_row is the toggled one before the first call)
+                const int* prev_labels = _matrix.get()+from_i+(_toggled_row^_toggle)*_cols;
+                T* min_dist = _distBuffer->begin()+from_i;
+                // unbuffered: previous labels are overwritten, every label counts as changed
+                if(_rows < 2) part_changed[part] += n_samples;
+                if constexpr(Metric::vectorized && (std::is_same<T, float>::value || std::is_same<T, double>::value)){
+                    simd::assign<Metric::kernel, D>(data.begin()+from_i, _cols, n_samples, cluster.begin(), n_clusters, n_dims, n_clusters,
+                                                    labels, min_dist);
+                } else {
+                    for(int i = 0; i < n_samples; ++i){
+                        T best = Metric::template dist<D>(data.begin()+from_i+i, _cols, cluster.begin(), n_clusters, n_dims);
+                        int k_index = 0;
+                        for(int c = 1; c < n_clusters; ++c){
+                            T dist = Metric::template dist<D>(data.begin()+from_i+i, _cols, cluster.begin()+c, n_clusters, n_dims);
+                            if(dist < best){
+                                k_index = c;
+                                best = dist;
+                            }
+                        }
+                        labels[i] = k_index;
+                        min_dist[i] = best;
+                    }
+                }
+                for(int i = 0; i < n_samples; ++i){
+                    if(_rows > 1) part_changed[part] += labels[i] != prev_labels[i];
+                    part_inertia[part] += min_dist[i];
+                    ++local_counts[labels[i]];
+                }
+                for(int d = 0; d < n_dims; ++d){
+                    const T* row = data.rowBegin(d) + from_i;
+                    T* feature_sums = local_sums + d*n_clusters;
+                    for(int i = 0; i < n_samples; ++i) feature_sums[labels[i]] += row[i];
+                }
+            }
+        }
+        reduction::treeReduce(part_sums, n_parts, sums_size, _n_threads);
+        reduction::treeReduce(part_counts, n_parts, n_clusters, _n_threads);
+        std::copy(part_sums, part_sums+sums_size, sums);
+        std::copy(part_counts, part_counts+n_clusters, counts);
+        changed = 0;
+        inertia = 0;
+        for(int part = 0; part < n_parts; ++part){
+            changed += part_changed[part];
+            inertia += part_inertia[part];
+        }
+        _current_row = _toggled_row;
+        _toggled_row ^= _toggle;
+        return *this;
+    }
+
+    /**
+     * getClosest over half precision samples (raw bits, NxM, see headers/Half.h).
+     * Each chunk of samples is converted to T in a per-thread NxChunk buffer that stays
+     * in cache and handed to the same kernels: the memory stream is halved while the
+     * distances are computed in T.
+    */
+    ClosestCentroids& getClosestHalf(const Matrix<uint16_t>& data, PrecisionEnum precision, const Matrix<T>& cluster){
+        assert(D == DYNAMIC_DIMS || D == data.getRows());
+        const int n_dims = D == DYNAMIC_DIMS ? data.getRows() : D;
+        int n_clusters = cluster.getCols();
+        int n_chunks = (_cols + _chunk_samples - 1) / _chunk_samples;
+
+        _workspace.reset();
+        T* buffers = _workspace.alloc<T>(static_cast<size_t>(_n_threads) * n_dims * _chunk_samples);
+
+        #pragma omp parallel num_threads(_n_threads)
+        {
+            T* buffer = buffers + static_cast<size_t>(omp_get_thread_num()) * n_dims * _chunk_samples;
+            #pragma omp for
+            for(int chunk = 0; chunk < n_chunks; ++chunk){
+                const int from_i = chunk * _chunk_samples;
+                const int n_samples = std::min(_chunk_samples, _cols - from_i);
+                for(int d = 0; d < n_dims; ++d) toT(data.rowBegin(d) + from_i, buffer + d*_chunk_samples, n_samples, precision);
+                if constexpr(Metric::vectorized && (std::is_same<T, float>::value || std::is_same<T, double>::value)){
+                    simd::assign<Metric::kernel, D>(buffer, _chunk_samples, n_samples, cluster.begin(), n_clusters, n_dims, n_clusters,
+                                                    _matrix.get()+from_i+_toggled_row*_cols, _distBuffer->begin()+from_i);
+                } else {
+                    for(int i = 0; i < n_samples; ++i){
+                        T min_dist = Metric::template dist<D>(buffer+i, _chunk_samples, cluster.begin(), n_clusters, n_dims);
+                        int k_index = 0;
+                        for(int c = 1; c < n_clusters; ++c){
+                            T dist = Metric::template dist<D>(buffer+i, _chunk_samples, cluster.begin()+c, n_clusters, n_dims);
+                            if(dist < min_dist){
+                                k_index = c;
+                                min_dist = dist;
+                            }
+                        }
+                        _matrix[from_i+i+_toggled_row*_cols] = k_index;
+                        (*_distBuffer)(0, from_i+i) = min_dist;
+                    }
+                }
+            }
+        }
+        _current_row = _toggled_row;
+        _toggled_row ^= _toggle;
+        return *this;
+    }
+
+    /**
+     * Converts n half precision values to T
+    */
+    static inline void toT(const uint16_t* src, T* dst, int n, PrecisionEnum precision){
+        if constexpr(std::is_same<T, float>::value) half::toFloat(src, dst, n, precision);
+        else {
+            for(int i = 0; i < n; ++i) dst[i] = static_cast<T>(half::toFloat(src[i], precision));
+        }
+    }
+
+    /**
+     * Cache blocked version of getClosest (same mapping). A block of samples sized to stay
+     * in L2 is compared to one block of centroids sized to stay in L1 at a time, the running
+     * minima of the samples being kept in the labels row and _distBuffer between centroids blocks.
+     * getClosest instead streams every centroid past each vector of samples, reloading
+     * the KxN centroids from L2 (or further) as soon as they don't fit in L1.
+    */
+    ClosestCentroids& getClosestBlocked(const Matrix<T>& data, const Matrix<T>& cluster){
+        const int n_dims = nDims(data);
+        int n_clusters = cluster.getCols();
+        int block_samples, block_clusters;
+        blockSizes(n_dims, n_clusters, block_samples, block_clusters);
+        int n_blocks = (_cols + block_samples - 1) / block_samples;
+
+        #pragma omp parallel for num_threads(_n_threads)
+        for(int block = 0; block < n_blocks; ++block){
+            const int from_i = block * block_samples;
+            const int n_samples = std::min(block_samples, _cols - from_i);
+            int* labels = _matrix.get()+from_i+_toggled_row*_cols;
+            T* min_dist = _distBuffer->begin()+from_i;
+            for(int from_c = 0; from_c < n_clusters; from_c += block_clusters){
+                const int n_block_clusters = std::min(block_clusters, n_clusters - from_c);
+                if constexpr(Metric::vectorized && (std::is_same<T, float>::value || std::is_same<T, double>::value)){
+                    if(!from_c) simd::assign<Metric::kernel, D>(data.begin()+from_i, _cols, n_samples, cluster.begin(), n_clusters,
+                                                                n_dims, n_block_clusters, labels, min_dist);
+                    else simd::assignBlock<Metric::kernel, D>(data.begin()+from_i, _cols, n_samples, cluster.begin()+from_c, n_clusters,
+                                                              n_dims, n_block_clusters, from_c, labels, min_dist);
+                } else {
+                    for(int i = 0; i < n_samples; ++i){
+                        if(!from_c){
+                            labels[i] = 0;
+                            min_dist[i] = std::numeric_limits<T>::max();
+                        }
+                        for(int c = from_c; c < from_c + n_block_clusters; ++c){
+                            T dist = Metric::template dist<D>(data.begin()+from_i+i, _cols, cluster.begin()+c, n_clusters, n_dims);
+                            if(dist < min_dist[i]){
+                                labels[i] = c;
+                                min_dist[i] = dist;
+                            }
+                        }
+                    }
+                }
+            }
+        }
+        _current_row = _toggled_row;
+        _toggled_row ^= _toggle;
+        return *this;
+    }
+
+    /**
+     * getClosest over a tiled copy of the samples (see headers/TiledMatrix.h):
+     * same mapping, but the samples are read as one sequential stream.
+     * Each tile is a NxW feature-major block of row stride W handed to the same kernels.
+    */
+    template<int W>
+    ClosestCentroids& getClosestTiled(const TiledMatrix<T, W>& data, const Matrix<T>& cluster){
+        assert(D == DYNAMIC_DIMS || D == data.getRows());
+        const int n_dims = D == DYNAMIC_DIMS ? data.getRows() : D;
+        int n_clusters = cluster.getCols();
+        const int chunk_tiles = std::max(1, _chunk_samples / W);
+        int n_chunks = (data.getTilesN() + chunk_tiles - 1) / chunk_tiles;
+
+        #pragma omp parallel for num_threads(_n_threads)
+        for(int chunk = 0; chunk < n_chunks; ++chunk){
+            const int to_tile = std::min(data.getTilesN(), (chunk+1) * chunk_tiles);
+            for(int t = chunk * chunk_tiles; t < to_tile; ++t){
+                const T* tile = data.tile(t);
+                const int from_i = t * W;
+                if constexpr(Metric::vectorized && (std::is_same<T, float>::value || std::is_same<T, double>::value)){
+                    simd::assign<Metric::kernel, D>(tile, W, data.tileSize(t), cluster.begin(), n_clusters, n_dims, n_clusters,
+                                                    _matrix.get()+from_i+_toggled_row*_cols, _distBuffer->begin()+from_i);
+                } else {
+                    for(int l = 0; l < data.tileSize(t); ++l){
+                        T min_dist = Metric::template dist<D>(tile+l, W, cluster.begin(), n_clusters, n_dims);
+                        int k_index = 0;
+                        for(int c = 1; c < n_clusters; ++c){
+                            T dist = Metric::template dist<D>(tile+l, W, cluster.begin()+c, n_clusters, n_dims);
+                            if(dist < min_dist){
+                                k_index = c;
+                                min_dist = dist;
+                            }
+                        }
+                        _matrix[from_i+l+_toggled_row*_cols] = k_index;
+                        (*_distBuffer)(0, from_i+l) = min_dist;
+                    }
+                }
+            }
+        }
+        _current_row = _toggled_row;
+        _toggled_row ^= _toggle;
+        return *this;
+    }
+
+    /**
+     * Elkan's accelerated version of getClosest. Produces the same mapping
+     * but skips the distance computations that the triangle inequality proves useless.
+     * State kept between calls:
+     *      _upperBound: 1xM upper bound of the distance between a sample and its centroid
+     *      _lowerBound: MxK lower bounds of the distances between a sample and each centroid,
+     *                   stored plus the total drift of the centroid when they were set
+     *      _secondBound: 1xM lower bound of the distance between a sample and any other
+     *                    centroid (Hamerly's bound)
+     *      _driftSum: total drift of each centroid since the first call
+     *      _prevCentroids: NxK centroids of the previous call (used to compute their drift)
+     * The lower bound of (i, c) is _lowerBound(i, c) - _driftSum[c], so the MxK bounds are
+     * neither decayed nor read for the samples whose upper bound stays below their second
+     * bound or half the distance from their centroid to the closest other one: those cost
+     * O(1). For the others the K bounds are filtered at once (simd::filter) and the
+     * distances to the candidates left computed together: the SIMD scan of every centroid
+     * when they are more than K / _elkan_scan_ratio, one by one otherwise.
+     * The first call computes every distance and initializes the bounds.
+    */
+    ClosestCentroids& getClosestElkan(const Matrix<T>& data, const Matrix<T>& cluster){
+        int n_clusters = cluster.getCols();
+
+        if(!_prevCentroids) initElkan(data, cluster);
+        else {
+            const int n_dims = nDims(data);
+            _workspace.reset();
+            T* drift = _workspace.alloc<T>(n_clusters);
+            T* half_min_dist = _workspace.alloc<T>(n_clusters);
+            updateCentroidsDist(cluster, drift, half_min_dist);
+            int max_drift_index;
+            T second_max_drift;
+            largestDrifts(drift, n_clusters, max_drift_index, second_max_drift);
+            // stored bound - drift sum rounds up by less than slack (stored bound + drift sum):
+            // the filter compares stored bound * (1 - slack) - drift sum * (1 + slack)
+            const T slack = 4 * std::numeric_limits<T>::epsilon();
+            T* offsets = _workspace.alloc<T>(n_clusters);
+            for(int c = 0; c < n_clusters; ++c){
+                _driftSum[c] += drift[c];
+                offsets[c] = _driftSum[c] * (1 + slack);
+            }
+            const T* drift_sum = _driftSum.data();
+            T* samples = _workspace.alloc<T>(static_cast<size_t>(_n_threads) * n_dims);
+            T* keys_buffers = _workspace.alloc<T>(static_cast<size_t>(_n_threads) * n_clusters);
+            int* candidates_buffers = _workspace.alloc<int>(static_cast<size_t>(_n_threads) * n_clusters);
+
+            #pragma omp parallel for num_threads(_n_threads)
+            for(int i = 0; i < _cols; ++i){
+                int k_index = _matrix[i+_current_row*_cols];
+                T upper = (*_upperBound)(0, i) + drift[k_index];
+                T second = (*_secondBound)(0, i) - (k_index == max_drift_index ? second_max_drift : drift[max_drift_index]);
+                const T bound = std::max(half_min_dist[k_index], second);
+                if(upper > bound){
+                    const size_t thread = omp_get_thread_num();
+                    T* lower = _lowerBound->rowBegin(i);
+                    upper = distance(data, i, cluster, k_index);
+                    lower[k_index] = upper + drift_sum[k_index];
+                    if(upper > bound){
+                        int* candidates = candidates_buffers + thread * n_clusters;
+                        const T* half_dist = _centroidsDist->rowBegin(k_index);
+                        // bounds of the centroids left out, the distances of the others are computed
+                        second = std::numeric_limits<T>::max();
+                        // keeps k_index out of the bound of the other centroids
+                        lower[k_index] = 0;
+                        int n_candidates;
+                        if constexpr(std::is_same<T, float>::value || std::is_same<T, double>::value){
+                            n_candidates = simd::filter(lower, offsets, half_dist, n_clusters, 1 - slack, upper, candidates, second);
+                        } else n_candidates = simd::filterScalar(lower, offsets, half_dist, n_clusters, 1 - slack, upper, candidates, second);
+                        T* keys = keys_buffers + thread * n_clusters;
+                        const bool scan = n_candidates * _elkan_scan_ratio > n_clusters;
+                        if(scan){
+                            T* sample = samples + thread * n_dims;
+                            gather(data, i, sample);
+                            pointsKeys(sample, cluster.begin(), n_clusters, n_clusters, n_dims, keys);
+                        }
+                        lower[k_index] = upper + drift_sum[k_index];
+                        const int k_prev = k_index;
+                        for(int n = 0; n < n_candidates; ++n){
+                            const int c = candidates[n];
+                            if(c == k_prev) continue;
+                            const T dist = scan ? metricOfKey(keys[c]) : distance(data, i, cluster, c);
+                            lower[c] = dist + drift_sum[c];
+                            if(dist < upper || (dist == upper && c < k_index)){
+                                second = std::min(second, upper);
+                                k_index = c;
+                                upper = dist;
+                            } else second = std::min(second, dist);
+                        }
+                    }
+                }
+                (*_upperBound)(0, i) = upper;
+                (*_secondBound)(0, i) = second;
+                _matrix[i+_toggled_row*_cols] = k_index;
+            }
+            std::copy(cluster.begin(), cluster.end(), _prevCentroids->begin());
+        }
+        _current_row = _toggled_row;
+        _toggled_row ^= _toggle;
+        return *this;
+    }
+
+    /**
+     * Hamerly's accelerated version of getClosest. Same mapping as getClosest
+     * with a single lower bound per sample (distance to the second closest centroid).
+     * State kept between calls:
+     *      _upperBound: 1xM upper bound of the distance between a sample and its centroid
+     *      _lowerBound: Mx1 lower bound of the distance between a sample and any other centroid
+     *      _prevCentroids: NxK centroids of the previous call (used to compute their drift)
+     * Samples are taken by chunks: the bounds are checked (and the upper bound tightened)
+     * sample by sample, those still left are gathered and scanned together by
+     * simd::assignTwo (vectorized metrics, one by one otherwise).
+     * The first call computes every distance and initializes the bounds.
+     * With 3 features (SquaredL2, M = 2000000, K = 30) it stays ~2x behind getClosest:
+     * 10 to 70% of the samples are scanned again at each call and the bounds pass alone
+     * (read and write both bounds and the label of every sample) costs half a SIMD scan.
+    */
+    ClosestCentroids& getClosestHamerly(const Matrix<T>& data, const Matrix<T>& cluster){
+        int n_clusters = cluster.getCols();
+
+        if(!_prevCentroids) initHamerly(data, cluster);
+        else {
+            _workspace.reset();
+            T* drift = _workspace.alloc<T>(n_clusters);
+            T* half_min_dist = _workspace.alloc<T>(n_clusters);
+            updateCentroidsDrift(cluster, drift, half_min_dist);
+            int max_drift_index;
+            T second_max_drift;
+            largestDrifts(drift, n_clusters, max_drift_index, second_max_drift);
+            const int n_dims = nDims(data);
+            int n_chunks = (_cols + _chunk_samples - 1) / _chunk_samples;
+            // per thread: indices of the samples left by the bounds, then by the tightened
+            // upper bounds, and their labels. Bounds, features of the samples to scan
+            // (feature-major, stride _chunk_samples) and both distances
+            int* left_buffers = _workspace.alloc<int>(static_cast<size_t>(_n_threads) * 3 * _chunk_samples);
+            T* features_buffers = _workspace.alloc<T>(static_cast<size_t>(_n_threads) * (n_dims + 3) * _chunk_samples);
+            T* samples = _workspace.alloc<T>(static_cast<size_t>(_n_threads) * n_dims);
+            T* keys_buffers = _workspace.alloc<T>(static_cast<size_t>(_n_threads) * n_clusters);
+
+            #pragma omp parallel for num_threads(_n_threads)
+            for(int chunk = 0; chunk < n_chunks; ++chunk){
+                const size_t thread = omp_get_thread_num();
+                const int from_i = chunk * _chunk_samples;
+                const int to_i = std::min(_cols, from_i + _chunk_samples);
+                int* left = left_buffers + thread * 3 * _chunk_samples;
+                int* scan = left + _chunk_samples;
+                int* labels = scan + _chunk_samples;
+                T* features = features_buffers + thread * (n_dims + 3) * _chunk_samples;
+                T* first = features + static_cast<size_t>(n_dims) * _chunk_samples;
+                T* second = first + _chunk_samples;
+                T* bounds = second + _chunk_samples;
+                // bounds moved by the drifts, no branch: the samples left are listed
+                int n_left = 0;
+                for(int i = from_i; i < to_i; ++i){
+                    const int k_index = _matrix[i+_current_row*_cols];
+                    const T upper = (*_upperBound)(0, i) + drift[k_index];
+                    const T lower = (*_lowerBound)(i, 0) - (k_index == max_drift_index ? second_max_drift : drift[max_drift_index]);
+                    (*_upperBound)(0, i) = upper;
+                    (*_lowerBound)(i, 0) = lower;
+                    _matrix[i+_toggled_row*_cols] = k_index;
+                    bounds[n_left] = std::max(half_min_dist[k_index], lower);
+                    left[n_left] = i;
+                    n_left += upper > bounds[n_left];
+                }
+                // exact upper bounds of the samples left, those still above their bound are scanned
+                int n_scan = 0;
+                for(int n = 0; n < n_left; ++n){
+                    const int i = left[n];
+                    const int k_index = _matrix[i+_toggled_row*_cols];
+                    const T upper = distance(data, i, cluster, k_index);
+                    (*_upperBound)(0, i) = upper;
+                    if constexpr(Metric::vectorized && (std::is_same<T, float>::value || std::is_same<T, double>::value)){
+                        scan[n_scan] = i;
+                        n_scan += upper > bounds[n];
+                    } else if(upper > bounds[n]){
+                        T* sample = samples + thread * n_dims;
+                        int k_closest;
+                        gather(data, i, sample);
+                        closestTwo(sample, cluster, keys_buffers + thread * n_clusters, k_closest, (*_upperBound)(0, i), (*_lowerBound)(i, 0));
+                        _matrix[i+_toggled_row*_cols] = k_closest;
+                    }
+                }
+                if(!n_scan) continue;
+                // SIMD scan of every centroid for the samples gathered
                 for(int d = 0; d < n_dims; ++d){
-                    abs_sum += std::abs(data(d, i) - cluster(d, c));
+                    const T* row = data.rowBegin(d);
+                    for(int n = 0; n < n_scan; ++n) features[n+d*_chunk_samples] = row[scan[n]];
+                }
+                if constexpr(Metric::vectorized && (std::is_same<T, float>::value || std::is_same<T, double>::value)){
+                    simd::assignTwo<Metric::kernel, D>(features, _chunk_samples, n_scan, cluster.begin(), n_clusters, n_dims, n_clusters,
+                                                       labels, first, second);
+                }
+                for(int n = 0; n < n_scan; ++n){
+                    const int i = scan[n];
+                    (*_upperBound)(0, i) = metricOfKey(first[n]);
+                    (*_lowerBound)(i, 0) = metricOfKey(second[n]);
+                    _matrix[i+_toggled_row*_cols] = labels[n];
                 }
-                if(abs_sum < (*_distBuffer)(0, i)){
-                    _matrix[i+_toggled_row*_cols] = c;
-                    (*_distBuffer)(0, i) = abs_sum;
+            }
+            std::copy(cluster.begin(), cluster.end(), _prevCentroids->begin());
+        }
+        _current_row = _toggled_row;
+        _toggled_row ^= _toggle;
+        return *this;
+    }
+
+    /**
+     * Yinyang's accelerated version of getClosest. Centroids are split in G groups
+     * (clustered once on the first call, see yinyangGroups) and each sample keeps a lower
+     * bound per group. A group whose bound exceeds the sample's upper bound is skipped altogether.
+     * State kept between calls:
+     *      _upperBound: 1xM upper bound of the distance between a sample and its centroid
+     *      _lowerBound: MxG lower bounds of the distances between a sample and each group,
+     *                   stored plus the total drift of the group when they were set
+     *      _secondBound: 1xM lower bound of the distance between a sample and any other
+     *                    centroid (global filter)
+     *      _driftSum: total drift of each group (largest drift of its centroids) since the first call
+     *      _prevCentroids: NxK centroids of the previous call (used to compute their drift)
+     * Samples are taken by chunks. Those kept by the global filter cost O(1), the others
+     * filter their G bounds at once (simd::filter). With a vectorized metric the groups
+     * left are then scanned group by group for all the samples of the chunk at once
+     * (scanGroups). Otherwise each group left is scanned for the sample alone unless the
+     * local filter proves every member farther than the upper bound.
+    */
+    ClosestCentroids& getClosestYinyang(const Matrix<T>& data, const Matrix<T>& cluster){
+        int n_clusters = cluster.getCols();
+
+        if(!_prevCentroids) initYinyang(data, cluster);
+        else {
+            int n_groups = static_cast<int>(_groupStart.size()) - 1;
+            const int n_dims = nDims(data);
+            _workspace.reset();
+            T* drift = _workspace.alloc<T>(n_clusters);
+            T* group_drift = _workspace.allocZero<T>(n_groups);
+            for(int c = 0; c < n_clusters; ++c){
+                drift[c] = distance(*_prevCentroids, c, cluster, c);
+                group_drift[_groupOf[c]] = std::max(group_drift[_groupOf[c]], drift[c]);
+            }
+            int max_drift_index;
+            T second_max_drift;
+            largestDrifts(drift, n_clusters, max_drift_index, second_max_drift);
+            // lazy group bounds, same rounding margin as getClosestElkan
+            const T slack = 4 * std::numeric_limits<T>::epsilon();
+            T* offsets = _workspace.alloc<T>(n_groups);
+            // no floor for the groups
+            T* floors = _workspace.allocZero<T>(n_groups);
+            for(int g = 0; g < n_groups; ++g){
+                _driftSum[g] += group_drift[g];
+                offsets[g] = _driftSum[g] * (1 + slack);
+            }
+            const T* drift_sum = _driftSum.data();
+            const int list_stride = fillLists(cluster);
+            int n_chunks = (_cols + _chunk_samples - 1) / _chunk_samples;
+            const size_t buffer_ints = scanGroupsInts(n_groups);
+            const size_t buffer_values = scanGroupsValues(n_dims);
+            int* int_buffers = _workspace.alloc<int>(static_cast<size_t>(_n_threads) * buffer_ints);
+            T* value_buffers = _workspace.alloc<T>(static_cast<size_t>(_n_threads) * buffer_values);
+            T* samples = _workspace.alloc<T>(static_cast<size_t>(_n_threads) * n_dims);
+            T* keys_buffers = _workspace.alloc<T>(static_cast<size_t>(_n_threads) * list_stride);
+            int* candidates_buffers = _workspace.alloc<int>(static_cast<size_t>(_n_threads) * n_groups);
+
+            #pragma omp parallel for num_threads(_n_threads)
+            for(int chunk = 0; chunk < n_chunks; ++chunk){
+                const size_t thread = omp_get_thread_num();
+                const int from_i = chunk * _chunk_samples;
+                const int to_i = std::min(_cols, from_i + _chunk_samples);
+                int* ints = int_buffers + thread * buffer_ints;
+                T* values = value_buffers + thread * buffer_values;
+                // samples left by the bounds: index, centroid and bounds so far
+                int* left = ints;
+                int* labels = left + _chunk_samples;
+                T* upper_left = values;
+                T* second_left = upper_left + _chunk_samples;
+                // samples left per group (slots in left)
+                int* group_sizes = labels + _chunk_samples;
+                int* group_left = group_sizes + n_groups;
+                std::fill(group_sizes, group_sizes + n_groups, 0);
+                T* sample = samples + thread * n_dims;
+                T* keys = keys_buffers + thread * list_stride;
+                int* candidates = candidates_buffers + thread * n_groups;
+                int n_left = 0;
+                for(int i = from_i; i < to_i; ++i){
+                    int k_index = _matrix[i+_current_row*_cols];
+                    T upper = (*_upperBound)(0, i) + drift[k_index];
+                    T second = (*_secondBound)(0, i) - (k_index == max_drift_index ? second_max_drift : drift[max_drift_index]);
+                    if(upper > second){
+                        upper = distance(data, i, cluster, k_index);
+                    }
+                    if(upper > second){
+                        T* lower = _lowerBound->rowBegin(i);
+                        second = std::numeric_limits<T>::max();
+                        int n_candidates;
+                        if constexpr(std::is_same<T, float>::value || std::is_same<T, double>::value){
+                            n_candidates = simd::filter(lower, offsets, floors, n_groups, 1 - slack, upper, candidates, second);
+                        } else n_candidates = simd::filterScalar(lower, offsets, floors, n_groups, 1 - slack, upper, candidates, second);
+                        if constexpr(Metric::vectorized && (std::is_same<T, float>::value || std::is_same<T, double>::value)){
+                            // scanned later, group by group with the other samples of the chunk
+                            for(int n = 0; n < n_candidates; ++n){
+                                const int g = candidates[n];
+                                group_left[g*_chunk_samples + group_sizes[g]++] = n_left;
+                            }
+                            left[n_left] = i;
+                            labels[n_left] = k_index;
+                            upper_left[n_left] = upper;
+                            second_left[n_left] = second;
+                            ++n_left;
+                            continue;
+                        }
+                        gather(data, i, sample);
+                        // lower bounds of its group don't cover the previous centroid
+                        const int k_prev = k_index;
+                        const T dist_prev = upper;
+                        for(int n = 0; n < n_candidates; ++n){
+                            const int g = candidates[n];
+                            // bound of the group before this call's drift, for the local filter
+                            const T lower_prev = lower[g] * (1 - slack) - offsets[g] + group_drift[g];
+                            T group_lower = std::numeric_limits<T>::max();
+                            const T* group_keys = keys + _listStart[g] - _groupStart[g];
+                            bool scanned = false;
+                            // closest two members scanned, the others only lower the group bound
+                            T best_key = std::numeric_limits<T>::max();
+                            T second_key = best_key;
+                            int best_c = -1;
+                            for(int m = _groupStart[g]; m < _groupStart[g+1]; ++m){
+                                const int c = _groupMembers[m];
+                                if(c == k_index) continue;
+                                if(c == k_prev){
+                                    group_lower = std::min(group_lower, dist_prev);
+                                    continue;
+                                }
+                                if(!scanned){
+                                    T local_lower = lower_prev - drift[c];
+                                    if(local_lower >= upper){
+                                        group_lower = std::min(group_lower, local_lower);
+                                        continue;
+                                    }
+                                    scanned = true;
+                                    pointsKeys(sample, _listPoints.data()+_listStart[g], list_stride, _listStart[g+1] - _listStart[g],
+                                               n_dims, keys + _listStart[g]);
+                                }
+                                const T key = group_keys[m];
+                                if(key < best_key){
+                                    second_key = best_key;
+                                    best_key = key;
+                                    best_c = c;
+                                } else second_key = std::min(second_key, key);
+                            }
+                            group_lower = std::min(group_lower, boundOfKey(second_key));
+                            if(best_c >= 0){
+                                const T dist = metricOfKey(best_key);
+                                if(dist < upper){
+                                    // previous closest centroid now bounds its own group
+                                    const int g_prev = _groupOf[k_index];
+                                    if(g_prev == g) group_lower = std::min(group_lower, upper);
+                                    else lower[g_prev] = std::min(lower[g_prev], upper + drift_sum[g_prev]);
+                                    second = std::min(second, upper);
+                                    k_index = best_c;
+                                    upper = dist;
+                                } else group_lower = std::min(group_lower, dist);
+                            }
+                            lower[g] = group_lower + drift_sum[g];
+                            second = std::min(second, group_lower);
+                        }
+                    }
+                    (*_upperBound)(0, i) = upper;
+                    (*_secondBound)(0, i) = second;
+                    _matrix[i+_toggled_row*_cols] = k_index;
                 }
+                if(n_left) scanGroups(data, n_left, list_stride, ints, values);
             }
+            std::copy(cluster.begin(), cluster.end(), _prevCentroids->begin());
         }
         _current_row = _toggled_row;
         _toggled_row ^= _toggle;
         return *this;
     }
 
+    /**
+     * Maps each sample to the closest centroid with a dot product based metric, e.g.
+     *      ||x - c||^2 = ||x||^2 - 2x.c + ||c||^2
+     * The x.c products of a tile of _tile_samples samples and a block of _tile_clusters
+     * centroids stay in registers (simd::gemmArgmin, register blocked, FMA) and are ranked
+     * right away (Metric::gemmEpilogue), so the MxK distance matrix is never stored.
+     * The expansion rounds differently than Metric::dist: when the best epilogue values of
+     * a sample are within Metric::gemmTolerance, the candidates are compared with Metric::dist,
+     * so the mapping is the one of getClosest. _distBuffer holds the exact Metric::dist.
+     * Falls back to getClosest if Metric is not dot product based.
+    */
+    ClosestCentroids& getClosestGemm(const Matrix<T>& data, const Matrix<T>& cluster){
+        if constexpr(!Metric::dot_based) return getClosest(data, cluster);
+        const int n_dims = nDims(data);
+        int n_clusters = cluster.getCols();
+
+        _workspace.reset();
+        T* cluster_norms = _workspace.allocZero<T>(n_clusters);
+        T* offsets = _workspace.alloc<T>(n_clusters);
+        T* scales = _workspace.alloc<T>(n_clusters);
+        for(int d = 0; d < n_dims; ++d){
+            const T* row = cluster.rowBegin(d);
+            for(int c = 0; c < n_clusters; ++c) cluster_norms[c] += row[c] * row[c];
+        }
+        for(int c = 0; c < n_clusters; ++c) Metric::gemmEpilogue(cluster_norms[c], offsets[c], scales[c]);
+        const T max_cluster_norm = *std::max_element(cluster_norms, cluster_norms + n_clusters);
+
+        int n_tiles = (_cols + _tile_samples - 1) / _tile_samples;
+        #pragma omp parallel for num_threads(_n_threads)
+        for(int tile = 0; tile < n_tiles; ++tile){
+            const int from_i = tile * _tile_samples;
+            const int tile_size = std::min(_tile_samples, _cols - from_i);
+            // three best epilogue values of each sample, indices of the two best
+            T best[_tile_samples];
+            T second[_tile_samples];
+            T third[_tile_samples];
+            int k_best[_tile_samples];
+            int k_second[_tile_samples];
+            for(int i = 0; i < tile_size; ++i){
+                best[i] = second[i] = third[i] = std::numeric_limits<T>::max();
+                k_best[i] = k_second[i] = 0;
+            }
+            const simd::GemmRanking<T> ranking{ best, second, third, k_best, k_second };
+            for(int from_c = 0; from_c < n_clusters; from_c += _tile_clusters){
+                const int tile_clusters = std::min(_tile_clusters, n_clusters - from_c);
+                if constexpr(std::is_same<T, float>::value || std::is_same<T, double>::value){
+                    simd::gemmArgmin(data.begin()+from_i, _cols, tile_size, cluster.begin()+from_c, n_clusters, n_dims,
+                                     tile_clusters, from_c, offsets+from_c, scales+from_c, ranking);
+                } else {
+                    simd::gemmArgminScalar(data.begin()+from_i, _cols, tile_size, cluster.begin()+from_c, n_clusters, n_dims,
+                                           tile_clusters, from_c, offsets+from_c, scales+from_c, ranking);
+                }
+            }
+            T sample_norms[_tile_samples] = {};
+            for(int d = 0; d < n_dims; ++d){
+                const T* row = data.rowBegin(d) + from_i;
+                for(int i = 0; i < tile_size; ++i) sample_norms[i] += row[i] * row[i];
+            }
+            for(int i = 0; i < tile_size; ++i){
+                const T* sample = data.begin() + from_i + i;
+                const T tolerance = Metric::gemmTolerance(sample_norms[i], max_cluster_norm, n_dims);
+                int k_index = k_best[i];
+                T min_dist = Metric::template dist<D>(sample, _cols, cluster.begin()+k_index, n_clusters, n_dims);
+                if(third[i] - best[i] <= tolerance){
+                    // 3 or more centroids in a near tie: exact scan (lowest index kept on ties as getClosest)
+                    k_index = 0;
+                    min_dist = Metric::template dist<D>(sample, _cols, cluster.begin(), n_clusters, n_dims);
+                    for(int c = 1; c < n_clusters; ++c){
+                        T dist = Metric::template dist<D>(sample, _cols, cluster.begin()+c, n_clusters, n_dims);
+                        if(dist < min_dist){
+                            k_index = c;
+                            min_dist = dist;
+                        }
+                    }
+                } else if(second[i] - best[i] <= tolerance){
+                    // the closest centroid is one of the two best
+                    T dist = Metric::template dist<D>(sample, _cols, cluster.begin()+k_second[i], n_clusters, n_dims);
+                    if(dist < min_dist || (dist == min_dist && k_second[i] < k_index)){
+                        k_index = k_second[i];
+                        min_dist = dist;
+                    }
+                }
+                _matrix[from_i+i+_toggled_row*_cols] = k_index;
+                (*_distBuffer)(0, from_i+i) = min_dist;
+            }
+        }
+        _current_row = _toggled_row;
+        _toggled_row ^= _toggle;
+        return *this;
+    }
+
+    /**
+     * Filtering version of getClosest: the kd-tree prunes the candidate centroids
+     * of each cell and assigns whole subtrees at once. Also accumulates the clusters
+     * sums (sums[c+d*K]) and sizes (counts) so the update doesn't need to scan the samples.
+     * The labels stay in tree order (_treeLabels, a subtree is a contiguous range),
+     * getChanged compares them as is and expandLabels scatters them to the samples order.
+    */
+    ClosestCentroids& getClosestFiltered(const KDTree<T, D>& tree, const Matrix<T>& data, const Matrix<T>& cluster, T* sums, int* counts){
+        if(!_treeLabels) _treeLabels = std::make_unique<Matrix<int>>(_rows, _cols, 0, _n_threads);
+        tree.filter(data, cluster, _treeLabels->rowBegin(_toggled_row), sums, counts);
+        _treeOrder = tree.getOrder();
+        _expanded = false;
+        _current_row = _toggled_row;
+        _toggled_row ^= _toggle;
+        return *this;
+    }
+
+    /**
+     * Labels of the last getClosestFiltered call written to the samples order (row of
+     * operator(), getLabels), nothing to do after the other engines. previous() is
+     * not expanded.
+    */
+    void expandLabels(){
+        if(_expanded) return;
+        const int* labels = _treeLabels->rowBegin(_current_row);
+        int* row = _matrix.get() + _current_row*_cols;
+        #pragma omp parallel for num_threads(_n_threads)
+        for(int m = 0; m < _cols; ++m) row[_treeOrder[m]] = labels[m];
+        _expanded = true;
+    }
+
+    /**
+     * Approximate version of getClosest for very large K. The centroids are clustered
+     * in sqrt(K) groups (inverted file kept between calls, see updateApproximateGroups) and
+     * each sample only scans the members of its _n_probes closest groups plus its previous
+     * centroid, so its cost never increases w.r.t. the previous mapping.
+     * Cost per sample: O((sqrt(K) + _n_probes * K/sqrt(K)) * N) instead of O(K * N).
+     * Every _exact_period calls (and on the first one) the exact getClosest is used instead,
+     * as well as when the probes would cover every group.
+    */
+    ClosestCentroids& getClosestApproximate(const Matrix<T>& data, const Matrix<T>& cluster){
+        const int n_dims = nDims(data);
+        int n_clusters = cluster.getCols();
+        const int n_groups = std::max(1, static_cast<int>(std::sqrt(static_cast<double>(n_clusters))));
+        const bool exact = !_approx_calls || (_exact_period > 0 && _approx_calls % _exact_period == 0);
+        ++_approx_calls;
+        if(exact || _n_probes >= n_groups) return getClosest(data, cluster);
+
+        _workspace.reset();
+        updateApproximateGroups(cluster, n_groups);
+        const int n_probes = std::max(1, _n_probes);
+        const int list_stride = fillLists(cluster);
+        const int center_stride = (n_groups + _list_align - 1) / _list_align * _list_align;
+        T* centers = _listPoints.data() + static_cast<size_t>(list_stride) * n_dims;
+        int max_list = center_stride;
+        for(int g = 0; g < n_groups; ++g) max_list = std::max(max_list, _listStart[g+1] - _listStart[g]);
+
+        // per thread buffers
+        T* dist_buffers = _workspace.alloc<T>(static_cast<size_t>(_n_threads) * (max_list + n_groups));
+        int* probes_buffers = _workspace.alloc<int>(static_cast<size_t>(_n_threads) * n_groups);
+        T* samples = _workspace.alloc<T>(static_cast<size_t>(_n_threads) * n_dims);
+
+        #pragma omp parallel num_threads(_n_threads)
+        {
+            const size_t thread_offset = static_cast<size_t>(omp_get_thread_num()) * (max_list + n_groups);
+            T* list_dist = dist_buffers + thread_offset;
+            T* group_dist = list_dist + max_list;
+            int* probes = probes_buffers + static_cast<size_t>(omp_get_thread_num()) * n_groups;
+            std::array<T, D == DYNAMIC_DIMS ? 1 : D> fixed_sample;
+            T* sample = D == DYNAMIC_DIMS ? samples + static_cast<size_t>(omp_get_thread_num()) * n_dims : fixed_sample.data();
+            #pragma omp for
+            for(int i = 0; i < _cols; ++i){
+                gather(data, i, sample);
+                pointsDist(sample, centers, center_stride, center_stride, n_dims, list_dist);
+                for(int g = 0; g < n_groups; ++g) group_dist[g] = list_dist[g];
+                for(int g = 0; g < n_groups; ++g) probes[g] = g;
+                // the n_probes closest groups, in any order
+                std::nth_element(probes, probes+n_probes-1, probes+n_groups,
+                                 [&](int a, int b){ return group_dist[a] < group_dist[b]; });
+
+                int k_index = _matrix[i+_current_row*_cols];
+                T min_dist = Metric::template dist<D>(sample, 1, cluster.begin()+k_index, n_clusters, n_dims);
+                for(int p = 0; p < n_probes; ++p){
+                    const int g = probes[p];
+                    const int from = _groupStart[g];
+                    const int size = _groupStart[g+1] - from;
+                    pointsDist(sample, _listPoints.data()+_listStart[g], list_stride, _listStart[g+1] - _listStart[g],
+                               n_dims, list_dist);
+                    for(int m = 0; m < size; ++m){
+                        const int c = _groupMembers[from+m];
+                        if(list_dist[m] < min_dist || (list_dist[m] == min_dist && c < k_index)){
+                            k_index = c;
+                            min_dist = list_dist[m];
+                        }
+                    }
+                }
+                _matrix[i+_toggled_row*_cols] = k_index;
+                (*_distBuffer)(0, i) = min_dist;
+            }
+        }
+        _current_row = _toggled_row;
+        _toggled_row ^= _toggle;
+        return *this;
+    }
+
+    /**
+     * Recall/speed trade-off of getClosestApproximate
+     *      n_probes: number of centroids groups scanned per sample (out of sqrt(K))
+     *      exact_period: an exact pass every exact_period calls, 0 to never
+     *                    run one after the first call
+    */
+    void setApproximation(int n_probes, int exact_period){
+        _n_probes = n_probes;
+        _exact_period = exact_period;
+    }
+
     /**
      * Checks whether the stopping criterion is satisfied or not.
      * If 2 consecutive closest centroids computation's modification
@@ -57,30 +946,626 @@ public:
      * KMeans has converged 
     */
     float getModifRate(){
+        return static_cast<float>(getChanged()) / _cols;
+    }
+    /**
+     * Number of samples whose label differs between the last two calls
+     * (every sample if unbuffered)
+    */
+    int getChanged(){
         // stopping criterion never satisfied if we dont keep track of assigned centroids modifications
-        if(_rows < 2) return 1.0f;
+        if(_rows < 2) return _cols;
+        // same count in the kd-tree order
+        const int* rows = _treeOrder ? _treeLabels->begin() : _matrix.get();
         int counter = 0;
         #pragma omp parallel for simd reduction(+:counter) num_threads(_n_threads)
         for(int i = 0; i < _cols; ++i){
-            const int& a = _matrix[i];
-            const int& b = _matrix[i+_cols];
-            if(!(a ^ b)) ++counter;
+            const int& a = rows[i];
+            const int& b = rows[i+_cols];
+            if(a ^ b) ++counter;
         }
-        return 1.0f - static_cast<float>(counter) / _cols;   
+        return counter;
     }
 
     inline int& operator()(const int& col) { return _matrix[col+_current_row*_cols]; }
     inline const int& operator()(const int& col) const { return _matrix[col+_current_row*_cols]; }
+    /**
+     * labels of the last call (label of sample i at [i])
+    */
+    inline const int* getLabels() const { return _matrix.get()+_current_row*_cols; }
+    /**
+     * label of the previous call (same as operator() if unbuffered)
+    */
+    inline const int& previous(const int& col) const { return _matrix[col+(_current_row^_toggle)*_cols]; }
+    inline bool isBuffered() const { return _rows > 1; }
+    /**
+     * Metric::dist of each sample to its centroid (getClosest and the engines keeping it)
+    */
+    inline const T* getDistances() const { return _distBuffer->begin(); }
 
 private:
     void initDistBuffer(){
         _distBuffer = std::make_unique<Matrix<T>>(1, _cols, 0, _n_threads);
     }
 
+    /**
+     * Computes every sample-centroid distance once to set exact bounds
+     * and the first mapping. Writes in the toggled row.
+     * The keys of a sample are computed in its lower bounds row (SIMD scan of every centroid)
+     * then turned into distances.
+    */
+    void initElkan(const Matrix<T>& data, const Matrix<T>& cluster){
+        int n_clusters = cluster.getCols();
+        _upperBound = std::make_unique<Matrix<T>>(1, _cols, 0, _n_threads);
+        _secondBound = std::make_unique<Matrix<T>>(1, _cols, 0, _n_threads);
+        _lowerBound = std::make_unique<Matrix<T>>(_cols, n_clusters, 0, _n_threads);
+        _centroidsDist = std::make_unique<Matrix<T>>(n_clusters, n_clusters, 0, _n_threads);
+        _prevCentroids = std::make_unique<Matrix<T>>(cluster);
+        _driftSum.assign(n_clusters, 0);
+        const int n_dims = nDims(data);
+        _workspace.reset();
+        T* samples = _workspace.alloc<T>(static_cast<size_t>(_n_threads) * n_dims);
+
+        #pragma omp parallel for num_threads(_n_threads)
+        for(int i = 0; i < _cols; ++i){
+            T* sample = samples + static_cast<size_t>(omp_get_thread_num()) * n_dims;
+            T* lower = _lowerBound->rowBegin(i);
+            int k_index;
+            gather(data, i, sample);
+            closestTwo(sample, cluster, lower, k_index, (*_upperBound)(0, i), (*_secondBound)(0, i));
+            for(int c = 0; c < n_clusters; ++c) lower[c] = metricOfKey(lower[c]);
+            _matrix[i+_toggled_row*_cols] = k_index;
+        }
+    }
+
+    void initHamerly(const Matrix<T>& data, const Matrix<T>& cluster){
+        _upperBound = std::make_unique<Matrix<T>>(1, _cols, 0, _n_threads);
+        _lowerBound = std::make_unique<Matrix<T>>(_cols, 1, 0, _n_threads);
+        _prevCentroids = std::make_unique<Matrix<T>>(cluster);
+        const int n_dims = nDims(data);
+        const int n_clusters = cluster.getCols();
+        if constexpr(Metric::vectorized && (std::is_same<T, float>::value || std::is_same<T, double>::value)){
+            // both bounds are contiguous: simd::assignTwo writes them by chunks
+            int n_chunks = (_cols + _chunk_samples - 1) / _chunk_samples;
+            #pragma omp parallel for num_threads(_n_threads)
+            for(int chunk = 0; chunk < n_chunks; ++chunk){
+                const int from_i = chunk * _chunk_samples;
+                const int n_samples = std::min(_chunk_samples, _cols - from_i);
+                T* upper = _upperBound->begin() + from_i;
+                T* lower = _lowerBound->begin() + from_i;
+                simd::assignTwo<Metric::kernel, D>(data.begin()+from_i, _cols, n_samples, cluster.begin(), n_clusters, n_dims, n_clusters,
+                                                   _matrix.get()+from_i+_toggled_row*_cols, upper, lower);
+                for(int l = 0; l < n_samples; ++l){
+                    upper[l] = metricOfKey(upper[l]);
+                    lower[l] = metricOfKey(lower[l]);
+                }
+            }
+            return;
+        }
+        _workspace.reset();
+        T* samples = _workspace.alloc<T>(static_cast<size_t>(_n_threads) * n_dims);
+        T* keys_buffers = _workspace.alloc<T>(static_cast<size_t>(_n_threads) * n_clusters);
+
+        #pragma omp parallel for num_threads(_n_threads)
+        for(int i = 0; i < _cols; ++i){
+            const size_t thread = omp_get_thread_num();
+            T* sample = samples + thread * n_dims;
+            int k_index;
+            gather(data, i, sample);
+            closestTwo(sample, cluster, keys_buffers + thread * n_clusters, k_index, (*_upperBound)(0, i), (*_lowerBound)(i, 0));
+            _matrix[i+_toggled_row*_cols] = k_index;
+        }
+    }
+
+    void initYinyang(const Matrix<T>& data, const Matrix<T>& cluster){
+        _workspace.reset();
+        groupCentroids(cluster, yinyangGroups(cluster.getCols()));
+        int n_groups = static_cast<int>(_groupStart.size()) - 1;
+        _upperBound = std::make_unique<Matrix<T>>(1, _cols, 0, _n_threads);
+        _secondBound = std::make_unique<Matrix<T>>(1, _cols, 0, _n_threads);
+        _lowerBound = std::make_unique<Matrix<T>>(_cols, n_groups, 0, _n_threads);
+        _prevCentroids = std::make_unique<Matrix<T>>(cluster);
+        _driftSum.assign(n_groups, 0);
+
+        const int n_dims = nDims(data);
+        const int n_clusters = cluster.getCols();
+        if constexpr(Metric::vectorized && (std::is_same<T, float>::value || std::is_same<T, double>::value)){
+            // every sample left, in every group
+            const int list_stride = fillLists(cluster);
+            int n_chunks = (_cols + _chunk_samples - 1) / _chunk_samples;
+            const size_t buffer_ints = scanGroupsInts(n_groups);
+            const size_t buffer_values = scanGroupsValues(n_dims);
+            int* int_buffers = _workspace.alloc<int>(static_cast<size_t>(_n_threads) * buffer_ints);
+            T* value_buffers = _workspace.alloc<T>(static_cast<size_t>(_n_threads) * buffer_values);
+            #pragma omp parallel for num_threads(_n_threads)
+            for(int chunk = 0; chunk < n_chunks; ++chunk){
+                const size_t thread = omp_get_thread_num();
+                const int from_i = chunk * _chunk_samples;
+                const int n_left = std::min(_cols, from_i + _chunk_samples) - from_i;
+                int* ints = int_buffers + thread * buffer_ints;
+                T* values = value_buffers + thread * buffer_values;
+                int* labels = ints + _chunk_samples;
+                int* group_sizes = labels + _chunk_samples;
+                int* group_left = group_sizes + n_groups;
+                for(int n = 0; n < n_left; ++n){
+                    ints[n] = from_i + n;
+                    labels[n] = 0;
+                    values[n] = values[n+_chunk_samples] = std::numeric_limits<T>::max();
+                }
+                for(int g = 0; g < n_groups; ++g){
+                    group_sizes[g] = n_left;
+                    for(int n = 0; n < n_left; ++n) group_left[g*_chunk_samples+n] = n;
+                }
+                scanGroups(data, n_left, list_stride, ints, values);
+            }
+            return;
+        }
+        T* samples = _workspace.alloc<T>(static_cast<size_t>(_n_threads) * n_dims);
+        T* keys_buffers = _workspace.alloc<T>(static_cast<size_t>(_n_threads) * n_clusters);
+
+        #pragma omp parallel for num_threads(_n_threads)
+        for(int i = 0; i < _cols; ++i){
+            const size_t thread = omp_get_thread_num();
+            T* sample = samples + thread * n_dims;
+            T* lower = _lowerBound->rowBegin(i);
+            T* keys = keys_buffers + thread * n_clusters;
+            gather(data, i, sample);
+            pointsKeys(sample, cluster.begin(), n_clusters, n_clusters, n_dims, keys);
+            int k_index = 0;
+            for(int c = 1; c < n_clusters; ++c){
+                if(keys[c] < keys[k_index]) k_index = c;
+            }
+            // keys are increasing with the metric: one conversion per group
+            T second_key = std::numeric_limits<T>::max();
+            for(int g = 0; g < n_groups; ++g){
+                T group_key = std::numeric_limits<T>::max();
+                for(int m = _groupStart[g]; m < _groupStart[g+1]; ++m){
+                    const int c = _groupMembers[m];
+                    if(c != k_index) group_key = std::min(group_key, keys[c]);
+                }
+                lower[g] = boundOfKey(group_key);
+                second_key = std::min(second_key, group_key);
+            }
+            (*_upperBound)(0, i) = metricOfKey(keys[k_index]);
+            (*_secondBound)(0, i) = boundOfKey(second_key);
+            _matrix[i+_toggled_row*_cols] = k_index;
+        }
+    }
+
+    /**
+     * Yinyang, vectorized metrics: the samples of a chunk left by the bounds are scanned
+     * group by group, each group against all its samples left at once (simd::assignTwo over
+     * the list of fillLists, features gathered feature-major). Buffers of a chunk, per thread:
+     *      ints (scanGroupsInts): indices of the n_left samples, their centroids (closest
+     *          so far), number of samples left in each group and their slots (G x _chunk_samples)
+     *      values (scanGroupsValues): their upper and second bounds (distance to the closest
+     *          centroid so far and lower bound of the groups not scanned), then scratch
+     * Sets the bounds of the groups scanned (closest member, the second closest in the group
+     * of the centroid), the label (toggled row), upper and second bounds of each sample.
+    */
+    void scanGroups(const Matrix<T>& data, int n_left, int list_stride, int* ints, T* values){
+        if constexpr(Metric::vectorized && (std::is_same<T, float>::value || std::is_same<T, double>::value)){
+            const int n_dims = nDims(data);
+            const int n_groups = static_cast<int>(_groupStart.size()) - 1;
+            const int* left = ints;
+            int* labels = ints + _chunk_samples;
+            const int* group_sizes = labels + _chunk_samples;
+            const int* group_left = group_sizes + n_groups;
+            int* group_labels = ints + scanGroupsInts(n_groups) - _chunk_samples;
+            T* upper = values;
+            T* second = upper + _chunk_samples;
+            T* first_keys = second + _chunk_samples;
+            T* second_keys = first_keys + _chunk_samples;
+            T* features = second_keys + _chunk_samples;
+            T* group_features = features + static_cast<size_t>(n_dims) * _chunk_samples;
+            // samples padded to a multiple of _list_align (copies of the first one) so that
+            // the kernel never runs its scalar tail, the extra results are ignored
+            auto padded = [&](int n_samples){ return std::min(_chunk_samples, (n_samples + _list_align - 1) / _list_align * _list_align); };
+            for(int d = 0; d < n_dims; ++d){
+                const T* row = data.rowBegin(d);
+                T* feature = features + d*_chunk_samples;
+                for(int n = 0; n < n_left; ++n) feature[n] = row[left[n]];
+                std::fill(feature + n_left, feature + padded(n_left), feature[0]);
+            }
+            for(int g = 0; g < n_groups; ++g){
+                const int n_samples = group_sizes[g];
+                const int* slots = group_left + g*_chunk_samples;
+                if(!n_samples) continue;
+                if(_groupStart[g+1] == _groupStart[g]){
+                    for(int n = 0; n < n_samples; ++n) _lowerBound->rowBegin(left[slots[n]])[g] = std::numeric_limits<T>::max();
+                    continue;
+                }
+                // slots are increasing: a group with every sample left uses their features as is
+                const T* scanned = features;
+                if(n_samples < n_left){
+                    for(int d = 0; d < n_dims; ++d){
+                        const T* feature = features + d*_chunk_samples;
+                        T* group_feature = group_features + d*_chunk_samples;
+                        for(int n = 0; n < n_samples; ++n) group_feature[n] = feature[slots[n]];
+                        std::fill(group_feature + n_samples, group_feature + padded(n_samples), group_feature[0]);
+                    }
+                    scanned = group_features;
+                }
+                simd::assignTwo<Metric::kernel, D>(scanned, _chunk_samples, padded(n_samples), _listPoints.data()+_listStart[g], list_stride,
+                                                   n_dims, _groupStart[g+1] - _groupStart[g], group_labels, first_keys, second_keys);
+                for(int n = 0; n < n_samples; ++n){
+                    const int slot = slots[n];
+                    T* lower = _lowerBound->rowBegin(left[slot]);
+                    const int closest = _groupMembers[_groupStart[g] + group_labels[n]];
+                    const T first = metricOfKey(first_keys[n]);
+                    T group_lower = boundOfKey(second_keys[n]);
+                    if(first < upper[slot]){
+                        // the previous closest centroid bounds its own group
+                        if(upper[slot] < std::numeric_limits<T>::max()){
+                            const int g_prev = _groupOf[labels[slot]];
+                            if(g_prev == g) group_lower = std::min(group_lower, upper[slot]);
+                            else lower[g_prev] = std::min(lower[g_prev], upper[slot] + _driftSum[g_prev]);
+                            second[slot] = std::min(second[slot], upper[slot]);
+                        }
+                        labels[slot] = closest;
+                        upper[slot] = first;
+                    } else if(closest != labels[slot]) group_lower = first;
+                    lower[g] = group_lower + _driftSum[g];
+                    second[slot] = std::min(second[slot], group_lower);
+                }
+            }
+            for(int n = 0; n < n_left; ++n){
+                const int i = left[n];
+                (*_upperBound)(0, i) = upper[n];
+                (*_secondBound)(0, i) = second[n];
+                _matrix[i+_toggled_row*_cols] = labels[n];
+            }
+        }
+    }
+    // scanGroups buffers of a chunk: ints and values of T
+    size_t scanGroupsInts(int n_groups) const {
+        return static_cast<size_t>(n_groups + 3) * _chunk_samples + n_groups;
+    }
+    size_t scanGroupsValues(int n_dims) const {
+        return static_cast<size_t>(2 * n_dims + 4) * _chunk_samples;
+    }
+
+    /**
+     * Number of Yinyang groups: K/10 as in the paper, at most _yinyang_max_groups so that
+     * the MxG bounds stay small (128 bytes per sample with floats) and each group scanned
+     * by scanGroups has enough members to amortize its pass over the samples
+     * (16 features, K = 4000: 32 groups on par with 16 or 64, 128 groups 1.4x slower)
+    */
+    static int yinyangGroups(int n_clusters){
+        return std::max(1, std::min(n_clusters / 10, _yinyang_max_groups));
+    }
+
+    /**
+     * Clusters the centroids themselves (a few Lloyd iterations) into n_groups
+     * groups. Fills _groupOf (centroid -> group), the groups centers (_groupCenters)
+     * and the members of each group stored contiguously: _groupMembers[_groupStart[g], _groupStart[g+1])
+    */
+    void groupCentroids(const Matrix<T>& cluster, int n_groups){
+        int n_clusters = cluster.getCols();
+        const int n_dims = nDims(cluster);
+        if(!_groupCenters || _groupCenters->getCols() != n_groups) _groupCenters = std::make_unique<Matrix<T>>(n_dims, n_groups, 0);
+        Matrix<T>& groups = *_groupCenters;
+        for(int g = 0; g < n_groups; ++g){
+            for(int d = 0; d < n_dims; ++d) groups(d, g) = cluster(d, g * n_clusters / n_groups);
+        }
+        _groupOf.assign(n_clusters, 0);
+        int* occurences = _workspace.alloc<int>(n_groups);
+        T* centroid = _workspace.alloc<T>(n_dims);
+        T* keys = _workspace.alloc<T>(n_groups);
+        for(int iter = 0; iter < 5; ++iter){
+            for(int c = 0; c < n_clusters; ++c){
+                gather(cluster, c, centroid);
+                pointsKeys(centroid, groups.begin(), n_groups, n_groups, n_dims, keys);
+                for(int g = 0; g < n_groups; ++g){
+                    if(keys[g] < keys[_groupOf[c]]) _groupOf[c] = g;
+                }
+            }
+            groupMeans(cluster, occurences);
+        }
+        _groupStart.assign(n_groups+1, 0);
+        for(int c = 0; c < n_clusters; ++c) ++_groupStart[_groupOf[c]+1];
+        for(int g = 0; g < n_groups; ++g) _groupStart[g+1] += _groupStart[g];
+        _groupMembers.assign(n_clusters, 0);
+        int* cursor = _workspace.alloc<int>(n_groups);
+        std::copy(_groupStart.begin(), _groupStart.end()-1, cursor);
+        for(int c = 0; c < n_clusters; ++c) _groupMembers[cursor[_groupOf[c]]++] = c;
+    }
+
+    /**
+     * Groups centers (_groupCenters) set to the mean of their members (_groupOf),
+     * an empty group keeps its center. occurences: G ints of scratch
+    */
+    void groupMeans(const Matrix<T>& cluster, int* occurences){
+        const int n_clusters = cluster.getCols();
+        const int n_dims = nDims(cluster);
+        Matrix<T>& groups = *_groupCenters;
+        const int n_groups = groups.getCols();
+        std::fill(occurences, occurences + n_groups, 0);
+        for(int c = 0; c < n_clusters; ++c) ++occurences[_groupOf[c]];
+        for(int g = 0; g < n_groups; ++g){
+            if(!occurences[g]) continue;
+            for(int d = 0; d < n_dims; ++d) groups(d, g) = 0;
+        }
+        for(int c = 0; c < n_clusters; ++c){
+            for(int d = 0; d < n_dims; ++d) groups(d, _groupOf[c]) += cluster(d, c);
+        }
+        for(int g = 0; g < n_groups; ++g){
+            if(!occurences[g]) continue;
+            for(int d = 0; d < n_dims; ++d) groups(d, g) /= occurences[g];
+        }
+    }
+
+    /**
+     * getClosestApproximate keeps its groups between calls: they are rebuilt every
+     * _regroup_period calls or as soon as a centroid drifted (since the grouping) by
+     * more than _regroup_drift times the mean distance between a centroid and its
+     * group center. Otherwise only the centers follow their members.
+    */
+    void updateApproximateGroups(const Matrix<T>& cluster, int n_groups){
+        const int n_clusters = cluster.getCols();
+        bool regroup = !_groupedCentroids || _groupedCentroids->getCols() != n_clusters
+                       || _groupCenters->getCols() != n_groups || _grouped_calls >= _regroup_period;
+        for(int c = 0; c < n_clusters && !regroup; ++c){
+            regroup = distance(*_groupedCentroids, c, cluster, c) > _regroup_drift * _groupRadius;
+        }
+        if(!regroup){
+            groupMeans(cluster, _workspace.alloc<int>(n_groups));
+            ++_grouped_calls;
+            return;
+        }
+        groupCentroids(cluster, n_groups);
+        _groupedCentroids = std::make_unique<Matrix<T>>(cluster);
+        _groupRadius = 0;
+        for(int c = 0; c < n_clusters; ++c) _groupRadius += distance(cluster, c, *_groupCenters, _groupOf[c]);
+        _groupRadius /= n_clusters;
+        _grouped_calls = 1;
+    }
+
+    /**
+     * The lower bound of a sample to the centroids other than its own moves by the biggest
+     * drift among them: index of the biggest drift and value of the second biggest one
+    */
+    static void largestDrifts(const T* drift, int n_clusters, int& max_drift_index, T& second_max_drift){
+        max_drift_index = 0;
+        second_max_drift = 0;
+        for(int c = 1; c < n_clusters; ++c){
+            if(drift[c] > drift[max_drift_index]){
+                second_max_drift = drift[max_drift_index];
+                max_drift_index = c;
+            } else if(drift[c] > second_max_drift) second_max_drift = drift[c];
+        }
+    }
+
+    /**
+     * Scans every centroid for sample (contiguous features) and returns the closest one's index
+     * and distance along with the distance to the second closest one (max value if K == 1).
+     * keys: K values of scratch
+    */
+    inline void closestTwo(const T* sample, const Matrix<T>& cluster, T* keys, int& k_index, T& first, T& second) const {
+        const int n_clusters = cluster.getCols();
+        pointsKeys(sample, cluster.begin(), n_clusters, n_clusters, nDims(cluster), keys);
+        k_index = 0;
+        T second_key = std::numeric_limits<T>::max();
+        for(int c = 1; c < n_clusters; ++c){
+            if(keys[c] < keys[k_index]){
+                second_key = keys[k_index];
+                k_index = c;
+            } else if(keys[c] < second_key) second_key = keys[c];
+        }
+        first = metricOfKey(keys[k_index]);
+        second = n_clusters > 1 ? metricOfKey(second_key) : second_key;
+    }
+
+    /**
+     * Computes the drift of each centroid since the previous call and
+     * stores the half distances between centroids in _centroidsDist.
+     * half_min_dist[c]: half distance between c and its closest neighbour
+    */
+    void updateCentroidsDist(const Matrix<T>& cluster, T* drift, T* half_min_dist){
+        int n_clusters = cluster.getCols();
+        const int n_dims = nDims(cluster);
+        T* centroid = _workspace.alloc<T>(n_dims);
+        T* keys = _workspace.alloc<T>(n_clusters);
+        for(int c = 0; c < n_clusters; ++c){
+            drift[c] = distance(*_prevCentroids, c, cluster, c);
+            half_min_dist[c] = std::numeric_limits<T>::max();
+            (*_centroidsDist)(c, c) = 0;
+            gather(cluster, c, centroid);
+            pointsKeys(centroid, cluster.begin(), n_clusters, c, n_dims, keys);
+            for(int c_other = 0; c_other < c; ++c_other){
+                T half_dist = metricOfKey(keys[c_other]) / 2;
+                (*_centroidsDist)(c, c_other) = half_dist;
+                (*_centroidsDist)(c_other, c) = half_dist;
+            }
+        }
+        for(int c = 0; c < n_clusters; ++c){
+            for(int c_other = 0; c_other < n_clusters; ++c_other){
+                if(c_other != c && (*_centroidsDist)(c, c_other) < half_min_dist[c]){
+                    half_min_dist[c] = (*_centroidsDist)(c, c_other);
+                }
+            }
+        }
+    }
+
+    /**
+     * Computes the drift of each centroid since the previous call and the half distance
+     * between each centroid and its closest neighbour (half_min_dist), without the KxK
+     * half distances of updateCentroidsDist
+    */
+    void updateCentroidsDrift(const Matrix<T>& cluster, T* drift, T* half_min_dist){
+        int n_clusters = cluster.getCols();
+        const int n_dims = nDims(cluster);
+        T* centroid = _workspace.alloc<T>(n_dims);
+        T* keys = _workspace.alloc<T>(n_clusters);
+        T* min_keys = _workspace.alloc<T>(n_clusters);
+        std::fill(min_keys, min_keys + n_clusters, std::numeric_limits<T>::max());
+        for(int c = 0; c < n_clusters; ++c){
+            drift[c] = distance(*_prevCentroids, c, cluster, c);
+            gather(cluster, c, centroid);
+            pointsKeys(centroid, cluster.begin(), n_clusters, c, n_dims, keys);
+            for(int c_other = 0; c_other < c; ++c_other){
+                min_keys[c] = std::min(min_keys[c], keys[c_other]);
+                min_keys[c_other] = std::min(min_keys[c_other], keys[c_other]);
+            }
+        }
+        for(int c = 0; c < n_clusters; ++c) half_min_dist[c] = metricOfKey(min_keys[c]) / 2;
+    }
+
+    /**
+     * Distances between one sample (contiguous features) and n points stored feature-major
+     * (feature d of point m at points[m+d*stride]). The distance being symmetric, the
+     * SIMD kernels vectorize it across the points (simd::distances).
+    */
+    inline void pointsDist(const T* sample, const T* points, int stride, int n, int n_dims, T* dist) const {
+        if constexpr(Metric::vectorized && (std::is_same<T, float>::value || std::is_same<T, double>::value)){
+            simd::distances<Metric::kernel, D>(points, stride, n, sample, 1, n_dims, dist);
+        } else {
+            for(int m = 0; m < n; ++m) dist[m] = Metric::template dist<D>(points+m, stride, sample, 1, n_dims);
+        }
+    }
+
+    /**
+     * Bound based engines: keys of the distances between one sample (contiguous features)
+     * and n points stored feature-major, increasing with Metric::metric so they can be
+     * ranked as is. Metric::dist from the SIMD kernels (pointsDist) if the metric is
+     * vectorized, Metric::metric otherwise. metricOfKey gives the value of distance back.
+    */
+    inline void pointsKeys(const T* sample, const T* points, int stride, int n, int n_dims, T* keys) const {
+        if constexpr(Metric::vectorized && (std::is_same<T, float>::value || std::is_same<T, double>::value)){
+            pointsDist(sample, points, stride, n, n_dims, keys);
+        } else {
+            for(int m = 0; m < n; ++m) keys[m] = Metric::template metric<D>(sample, 1, points+m, stride, n_dims);
+        }
+    }
+    static inline T metricOfKey(T key){
+        if constexpr(Metric::vectorized && (std::is_same<T, float>::value || std::is_same<T, double>::value)){
+            return Metric::metricOfDist(key);
+        } else return key;
+    }
+    // metricOfKey of a bound, the max value (no point) is kept as is
+    static inline T boundOfKey(T key){
+        return key < std::numeric_limits<T>::max() ? metricOfKey(key) : key;
+    }
+
+    /**
+     * Contiguous copy of the features of column i of data
+    */
+    inline void gather(const Matrix<T>& data, int i, T* sample) const {
+        const int n_dims = nDims(data);
+        for(int d = 0; d < n_dims; ++d) sample[d] = data(d, i);
+    }
+
+    /**
+     * Copies the centroids in _groupMembers order (still feature-major) into _listPoints:
+     * list g at columns [_listStart[g], _listStart[g+1]), padded to a multiple of _list_align
+     * so the SIMD kernels never run their scalar tail, followed by the groups centers
+     * (_list_align padded as well). Returns the stride of the lists.
+    */
+    int fillLists(const Matrix<T>& cluster){
+        const int n_dims = nDims(cluster);
+        const int n_groups = static_cast<int>(_groupStart.size()) - 1;
+        _listStart.assign(n_groups+1, 0);
+        for(int g = 0; g < n_groups; ++g){
+            const int size = _groupStart[g+1] - _groupStart[g];
+            _listStart[g+1] = _listStart[g] + (size + _list_align - 1) / _list_align * _list_align;
+        }
+        const int list_stride = _listStart[n_groups];
+        const int center_stride = (n_groups + _list_align - 1) / _list_align * _list_align;
+        _listPoints.assign(static_cast<size_t>(list_stride + center_stride) * n_dims, 0);
+        T* centers = _listPoints.data() + static_cast<size_t>(list_stride) * n_dims;
+        for(int g = 0; g < n_groups; ++g){
+            for(int m = _groupStart[g]; m < _groupStart[g+1]; ++m){
+                for(int d = 0; d < n_dims; ++d) _listPoints[_listStart[g]+m-_groupStart[g]+d*list_stride] = cluster(d, _groupMembers[m]);
+            }
+            for(int d = 0; d < n_dims; ++d) centers[g+d*center_stride] = (*_groupCenters)(d, g);
+        }
+        return list_stride;
+    }
+
+    /**
+     * getClosestBlocked blocks: centroids of a block take half of L1 and the samples
+     * of a block (features, label and distance) half of L2. Samples blocks are a multiple
+     * of 64 and small enough to give every thread some work.
+    */
+    void blockSizes(int n_dims, int n_clusters, int& block_samples, int& block_clusters) const {
+        const long l1 = simd::cacheSize(1);
+        const long l2 = simd::cacheSize(2);
+        block_clusters = static_cast<int>(std::min<long>(n_clusters, std::max<long>(1, l1 / 2 / (n_dims * sizeof(T)))));
+        block_samples = static_cast<int>(std::max<long>(64, l2 / 2 / ((n_dims + 1) * sizeof(T) + sizeof(int)) / 64 * 64));
+        const int per_thread = (_cols + _n_threads - 1) / _n_threads;
+        block_samples = std::min(block_samples, std::max(64, (per_thread + 63) / 64 * 64));
+    }
+
+    /**
+     * Number of features (rows) of data, constant if D is specified
+    */
+    inline int nDims(const Matrix<T>& data) const {
+        assert(D == DYNAMIC_DIMS || D == data.getRows());
+        return D == DYNAMIC_DIMS ? data.getRows() : D;
+    }
+
+    /**
+     * Distance between column i of lhs and column j of rhs as a true metric
+     * (Metric::metric) so that bounds can rely on the triangle inequality
+    */
+    inline T distance(const Matrix<T>& lhs, int i, const Matrix<T>& rhs, int j) const {
+        return Metric::template metric<D>(lhs.begin()+i, lhs.getCols(), rhs.begin()+j, rhs.getCols(), nDims(lhs));
+    }
+
     std::unique_ptr<Matrix<T>> _distBuffer;
+    // getClosestFiltered: labels in the kd-tree order (label of sample _treeOrder[m] at [m]),
+    // _expanded once the current row is written to _matrix
+    std::unique_ptr<Matrix<int>> _treeLabels;
+    const int* _treeOrder = nullptr;
+    bool _expanded = true;
+    // engines scratch memory, reset at each call (no allocation once warmed up)
+    Workspace _workspace;
+    // samples processed per getClosest task
+    static constexpr int _chunk_samples = 1024;
+    // getClosestGemm tiles dimensions
+    static constexpr int _tile_samples = 128;
+    static constexpr int _tile_clusters = 32;
     // we want to store the previous state of mapped centroids, toggle: 1 to switch between rows
     int _toggle = 0;
     // we store the toggled row
     int _toggled_row = 0;
     int _current_row = 0;
+
+    // Elkan/Hamerly bounds (allocated on first call)
+    std::unique_ptr<Matrix<T>> _upperBound;
+    // MxK (Elkan), Mx1 (Hamerly) or MxG (Yinyang)
+    std::unique_ptr<Matrix<T>> _lowerBound;
+    // half distances between centroids: KxK
+    std::unique_ptr<Matrix<T>> _centroidsDist;
+    // Elkan, Yinyang: 1xM bound of the distance to any other centroid
+    std::unique_ptr<Matrix<T>> _secondBound;
+    // Elkan: total drift of each centroid (Yinyang: of each group), offset of the stored lower bounds
+    std::vector<T> _driftSum;
+    // Elkan: distances of a sample computed by a SIMD scan of every centroid
+    // when more than K / _elkan_scan_ratio are left by the bounds
+    static constexpr int _elkan_scan_ratio = 16;
+    // Yinyang: cap of the number of groups
+    static constexpr int _yinyang_max_groups = 32;
+    std::unique_ptr<Matrix<T>> _prevCentroids;
+    // Yinyang centroids groups
+    std::vector<int> _groupOf;
+    std::vector<int> _groupStart;
+    std::vector<int> _groupMembers;
+    std::unique_ptr<Matrix<T>> _groupCenters;
+    // inverted lists (getClosestApproximate, Yinyang groups scans): centroids in _groupMembers
+    // order, list g at columns [_listStart[g], _listStart[g+1]) followed by the groups centers
+    std::vector<T> _listPoints;
+    std::vector<int> _listStart;
+    static constexpr int _list_align = 16;
+    // getClosestApproximate settings and number of calls
+    int _n_probes = 4;
+    int _exact_period = 10;
+    int _approx_calls = 0;
+    // getClosestApproximate groups: centroids when grouped, mean distance to their group
+    // center then, calls since (see updateApproximateGroups)
+    std::unique_ptr<Matrix<T>> _groupedCentroids;
+    T _groupRadius = 0;
+    int _grouped_calls = 0;
+    static constexpr int _regroup_period = 10;
+    static constexpr T _regroup_drift = 0.5;
 };
\ No newline at end of file
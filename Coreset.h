@@ -0,0 +1,110 @@
+#pragma once
+
+#include <vector>
+#include <memory>
+#include <random>
+#include <cmath>
+#include <cstdint>
+#include <algorithm>
+
+#include "headers/Matrix.h"
+#include "headers/Reduction.h"
+#include "ClosestCentroids.h"
+#include "Seeding.h"
+
+/**
+ * Weighted subset of a dataset: points (NxS) and their weights, to be trained
+ * on with KMeans(coreset.points, ..., coreset.weights)
+*/
+template<typename T>
+struct Coreset {
+    std::shared_ptr<const Matrix<T>> points;
+    std::shared_ptr<const std::vector<T>> weights;
+};
+
+/**
+ * Coreset of size samples of the NxM dataset by sensitivity sampling
+ * (Lucic, Bachem & Krause, Strong coresets for hard and soft Bregman clustering):
+ *      1. n_clusters rough centroids B by a seeding method (AFK_MC2: one pass)
+ *      2. one pass mapping every sample x to B: d(x) = Metric::dist(x, B), cluster B_x
+ *      3. sensitivity s(x) = a d(x) / mean(d) + 2a sum_{B_x} d / (|B_x| mean(d)) + 4M / |B_x|,
+ *         a = 16 (log K + 2), and size draws with probability q = s / sum(s)
+ *         (weight 1 / (size q), so the weighted cost of the coreset is an unbiased
+ *         estimate of the cost of the dataset for any centroids)
+ * Only the sensitivities are scanned after the second pass. Same coreset whatever
+ * the number of threads.
+*/
+template<typename T, int D = DYNAMIC_DIMS, typename Metric = SquaredL2<T>>
+Coreset<T> buildCoreset(const Matrix<T>& dataset, int size, int n_clusters, uint64_t seed=0, int n_threads=1,
+                        SeedEnum seeding=AFK_MC2, SeedParams seed_params=SeedParams()){
+    const int n_dims = dataset.getRows();
+    const int n_samples = dataset.getCols();
+    assert(size > 0 && n_samples > 0 && seeding != UNIFORM_BOX);
+    std::mt19937_64 rng(seed);
+
+    std::unique_ptr<Matrix<T>> rough = seedCentroids<T, D, Metric>(dataset, n_clusters, seeding, rng(), n_threads, seed_params);
+
+    ClosestCentroids<T, D, Metric> labels(n_samples, 0, false, n_threads);
+    labels.getClosest(dataset, *rough);
+    const T* dist = labels.getDistances();
+
+    // clusters sizes and costs (deterministic parts, see headers/Reduction.h)
+    constexpr int chunk = 1024;
+    const int n_parts = reduction::partsN(n_samples, chunk, 4*n_clusters);
+    std::vector<double> part_costs(static_cast<size_t>(n_parts) * n_clusters, 0);
+    std::vector<double> part_sizes(static_cast<size_t>(n_parts) * n_clusters, 0);
+    #pragma omp parallel for num_threads(n_threads)
+    for(int part = 0; part < n_parts; ++part){
+        const int from = reduction::partBegin(part, n_parts, n_samples, chunk);
+        const int to = reduction::partBegin(part+1, n_parts, n_samples, chunk);
+        double* costs = part_costs.data() + static_cast<size_t>(part)*n_clusters;
+        double* sizes = part_sizes.data() + static_cast<size_t>(part)*n_clusters;
+        for(int i = from; i < to; ++i){
+            costs[labels(i)] += dist[i];
+            sizes[labels(i)] += 1;
+        }
+    }
+    reduction::treeReduce(part_costs.data(), n_parts, n_clusters, n_threads);
+    reduction::treeReduce(part_sizes.data(), n_parts, n_clusters, n_threads);
+    double mean_cost = 0;
+    for(int c = 0; c < n_clusters; ++c) mean_cost += part_costs[c];
+    mean_cost /= n_samples;
+
+    // sensitivities cumulative distribution, parts scanned in parallel then offset
+    const double alpha = 16 * (std::log(static_cast<double>(n_clusters)) + 2);
+    std::vector<double> cumulative(n_samples);
+    std::vector<double> part_offsets(n_parts+1, 0);
+    #pragma omp parallel for num_threads(n_threads)
+    for(int part = 0; part < n_parts; ++part){
+        const int from = reduction::partBegin(part, n_parts, n_samples, chunk);
+        const int to = reduction::partBegin(part+1, n_parts, n_samples, chunk);
+        double acc = 0;
+        for(int i = from; i < to; ++i){
+            const int c = labels(i);
+            double sensitivity = 4. * n_samples / part_sizes[c];
+            if(mean_cost > 0) sensitivity += alpha * dist[i] / mean_cost + 2 * alpha * part_costs[c] / (part_sizes[c] * mean_cost);
+            acc += sensitivity;
+            cumulative[i] = acc;
+        }
+        part_offsets[part+1] = acc;
+    }
+    for(int part = 0; part < n_parts; ++part) part_offsets[part+1] += part_offsets[part];
+    #pragma omp parallel for num_threads(n_threads)
+    for(int part = 1; part < n_parts; ++part){
+        const int from = reduction::partBegin(part, n_parts, n_samples, chunk);
+        const int to = reduction::partBegin(part+1, n_parts, n_samples, chunk);
+        for(int i = from; i < to; ++i) cumulative[i] += part_offsets[part];
+    }
+    const double total = cumulative[n_samples-1];
+
+    auto points = std::make_shared<Matrix<T>>(n_dims, size, 0, n_threads);
+    auto weights = std::make_shared<std::vector<T>>(size);
+    std::uniform_real_distribution<double> uniform(0, 1);
+    for(int j = 0; j < size; ++j){
+        const int i = std::min(n_samples-1, static_cast<int>(std::upper_bound(cumulative.begin(), cumulative.end(), uniform(rng) * total) - cumulative.begin()));
+        const double q = (cumulative[i] - (i ? cumulative[i-1] : 0)) / total;
+        (*weights)[j] = static_cast<T>(1 / (size * q));
+        for(int d = 0; d < n_dims; ++d) (*points)(d, j) = dataset(d, i);
+    }
+    return Coreset<T>{ std::move(points), std::move(weights) };
+}
@@ -0,0 +1,338 @@
+#pragma once
+
+#include <vector>
+#include <algorithm>
+#include <limits>
+#include <utility>
+#include <omp.h>
+
+#include "headers/Matrix.h"
+#include "headers/Reduction.h"
+#include "headers/Workspace.h"
+#include "Metrics.h"
+
+/**
+ * kd-tree over the samples of a NxM dataset used by the filtering algorithm
+ * (Kanungo et al.) with the squared euclidean distance.
+ * Each node keeps its bounding box and the sum of its samples, so a subtree
+ * whose cell can only belong to one centroid is assigned and accumulated at once.
+ * Nodes refer to ranges of a permutation of the samples indices (tree order). The samples
+ * are also copied in that order (sample-major) so that the build and the leaves only
+ * read contiguous memory, and the labels are written in that order too.
+ * Nodes have fixed slots (left child right after its parent, then the right subtree) so
+ * the subtrees are built in parallel; a leaf made early (samples all at the same position)
+ * leaves the slots of its would-be subtree unused.
+ * D: number of features if known at compile time (DYNAMIC_DIMS otherwise)
+*/
+template<typename T, int D = DYNAMIC_DIMS>
+class KDTree{
+public:
+    KDTree(const Matrix<T>& data, int leaf_size = 16, int n_threads = 1);
+
+    /**
+     * Maps each sample to its closest centroid and accumulates the clusters sums.
+     *      labels: M cluster indices in tree order, label of sample getOrder()[m] at [m]
+     *              (a subtree assigned at once is a contiguous range)
+     *      sums: NxK samples sums, feature d of cluster c at sums[c+d*K]
+     *      counts: K number of samples per cluster
+     * sums and counts are overwritten.
+    */
+    void filter(const Matrix<T>& data, const Matrix<T>& cluster, int* labels, T* sums, int* counts) const;
+
+    int getNodesN() const { return static_cast<int>(_nodes.size()); }
+    /**
+     * Samples indices in tree order (M ints)
+    */
+    const int* getOrder() const { return _indices.data(); }
+
+private:
+    struct Node {
+        // range of _indices covered by the node
+        int from, to;
+        // children indices in _nodes, -1 for leaves
+        int left = -1, right = -1;
+    };
+
+    void build(int node, int from, int to);
+    void select(int from, int to, int mid, int split_dim);
+    std::pair<int, int> subtreeNodes(int n_samples) const;
+    void filterNode(const Matrix<T>& data, const Matrix<T>& cluster, int node,
+                    const int* candidates, int n_candidates, int* scratch,
+                    int* labels, double* sums, int* counts) const;
+    void assignSubtree(int node, int k_index, int n_clusters, int* labels, double* sums, int* counts) const;
+    bool isFarther(const Matrix<T>& cluster, int z, int z_star, int node) const;
+
+    inline int nDims() const { return D == DYNAMIC_DIMS ? _dims : D; }
+
+    int _dims;
+    int _leaf_size;
+    int _n_threads;
+    int _depth = 0;
+    std::vector<Node> _nodes;
+    std::vector<int> _indices;
+    // samples in _indices order: feature d of _indices[m] at _points[m*n_dims+d]
+    std::vector<T> _points;
+    // per node (node*n_dims+d): bounding box and samples sums
+    std::vector<T> _box_min;
+    std::vector<T> _box_max;
+    std::vector<double> _node_sums;
+    // subtrees of at least _task_samples samples are built by their own task
+    static constexpr int _task_samples = 1 << 15;
+    // nodes filtered in parallel (disjoint subtrees covering the dataset)
+    std::vector<int> _frontier;
+    // filter scratch memory (accumulators and candidates lists)
+    mutable Workspace _workspace;
+};
+
+template<typename T, int D>
+KDTree<T, D>::KDTree(const Matrix<T>& data, int leaf_size, int n_threads) :
+        _dims{ data.getRows() },
+        _leaf_size{ std::max(1, leaf_size) },
+        _n_threads{ n_threads } {
+
+    assert(D == DYNAMIC_DIMS || D == data.getRows());
+    const int n_samples = data.getCols();
+    const int n_dims = nDims();
+    _indices.resize(n_samples);
+    _points.resize(static_cast<size_t>(n_samples) * n_dims);
+    #pragma omp parallel for num_threads(_n_threads)
+    for(int m = 0; m < n_samples; ++m){
+        _indices[m] = m;
+        for(int d = 0; d < n_dims; ++d) _points[static_cast<size_t>(m)*n_dims+d] = data(d, m);
+    }
+    const int n_nodes = subtreeNodes(n_samples).first;
+    _nodes.resize(n_nodes);
+    _box_min.resize(static_cast<size_t>(n_nodes) * n_dims);
+    _box_max.resize(static_cast<size_t>(n_nodes) * n_dims);
+    _node_sums.resize(static_cast<size_t>(n_nodes) * n_dims);
+    // deepest path: the larger half at each split
+    for(int n = n_samples; n > _leaf_size; n -= n / 2) ++_depth;
+    #pragma omp parallel num_threads(_n_threads)
+    {
+        #pragma omp single
+        build(0, 0, n_samples);
+    }
+
+    // breadth first split until there is enough subtrees to feed the threads. The split
+    // doesn't depend on n_threads so the sums are reduced in the same order for any of them
+    _frontier.push_back(0);
+    while(static_cast<int>(_frontier.size()) < reduction::max_parts){
+        std::vector<int> next;
+        for(int node : _frontier){
+            if(_nodes[node].left < 0) next.push_back(node);
+            else {
+                next.push_back(_nodes[node].left);
+                next.push_back(_nodes[node].right);
+            }
+        }
+        if(next.size() == _frontier.size()) break;
+        _frontier.swap(next);
+    }
+}
+
+/**
+ * Builds the subtree covering the samples [from, to) (tree order) at slot node.
+ * Splits the widest feature of the bounding box at the median sample.
+*/
+template<typename T, int D>
+void KDTree<T, D>::build(int node, int from, int to){
+    const int n_dims = nDims();
+    _nodes[node] = Node{ from, to };
+    T* box_min = _box_min.data() + static_cast<size_t>(node)*n_dims;
+    T* box_max = _box_max.data() + static_cast<size_t>(node)*n_dims;
+    double* node_sums = _node_sums.data() + static_cast<size_t>(node)*n_dims;
+    std::fill(box_min, box_min + n_dims, std::numeric_limits<T>::max());
+    std::fill(box_max, box_max + n_dims, std::numeric_limits<T>::lowest());
+    for(int m = from; m < to; ++m){
+        const T* point = _points.data() + static_cast<size_t>(m)*n_dims;
+        for(int d = 0; d < n_dims; ++d){
+            box_min[d] = std::min(box_min[d], point[d]);
+            box_max[d] = std::max(box_max[d], point[d]);
+            node_sums[d] += point[d];
+        }
+    }
+    if(to - from <= _leaf_size) return;
+
+    int split_dim = 0;
+    for(int d = 1; d < n_dims; ++d){
+        if(box_max[d] - box_min[d] > box_max[split_dim] - box_min[split_dim]) split_dim = d;
+    }
+    // every sample at the same position
+    if(box_max[split_dim] <= box_min[split_dim]) return;
+
+    const int mid = from + (to - from) / 2;
+    select(from, to, mid, split_dim);
+    const int left = node + 1;
+    const int right = left + subtreeNodes(mid - from).first;
+    _nodes[node].left = left;
+    _nodes[node].right = right;
+    if(to - from >= _task_samples){
+        #pragma omp task
+        build(left, from, mid);
+    } else build(left, from, mid);
+    build(right, mid, to);
+}
+
+/**
+ * Quickselect on feature split_dim of the samples [from, to): the sample of rank
+ * mid - from ends up at mid, those before are not larger and those after not smaller.
+ * Rows of _points are swapped along with _indices.
+*/
+template<typename T, int D>
+void KDTree<T, D>::select(int from, int to, int mid, int split_dim){
+    const int n_dims = nDims();
+    auto key = [&](int m){ return _points[static_cast<size_t>(m)*n_dims+split_dim]; };
+    int low = from;
+    int high = to - 1;
+    while(low < high){
+        // median of three: Hoare's partition never leaves an empty side
+        const T a = key(low);
+        const T b = key(low + (high - low) / 2);
+        const T c = key(high);
+        const T pivot = std::max(std::min(a, b), std::min(std::max(a, b), c));
+        int i = low - 1;
+        int j = high + 1;
+        while(true){
+            do ++i; while(key(i) < pivot);
+            do --j; while(key(j) > pivot);
+            if(i >= j) break;
+            std::swap(_indices[i], _indices[j]);
+            std::swap_ranges(_points.begin() + static_cast<size_t>(i)*n_dims, _points.begin() + static_cast<size_t>(i+1)*n_dims,
+                             _points.begin() + static_cast<size_t>(j)*n_dims);
+        }
+        // [low, j] <= pivot <= [j+1, high]
+        if(mid <= j) high = j;
+        else low = j + 1;
+    }
+}
+
+/**
+ * Number of node slots of a subtree over n_samples samples and over n_samples + 1
+ * (the halves of n and n + 1 samples are both among n/2 and n/2 + 1)
+*/
+template<typename T, int D>
+std::pair<int, int> KDTree<T, D>::subtreeNodes(int n_samples) const {
+    if(n_samples < _leaf_size) return { 1, 1 };
+    if(n_samples == _leaf_size) return { 1, 3 };
+    const int half = n_samples / 2;
+    const std::pair<int, int> halves = subtreeNodes(half);
+    // n_samples = 2h: h + h, 2h + 1: h + (h+1), 2h + 2: (h+1) + (h+1)
+    if(n_samples % 2 == 0) return { 1 + 2*halves.first, 1 + halves.first + halves.second };
+    return { 1 + halves.first + halves.second, 1 + 2*halves.second };
+}
+
+template<typename T, int D>
+void KDTree<T, D>::filter(const Matrix<T>& data, const Matrix<T>& cluster, int* labels, T* sums, int* counts) const {
+    const int n_dims = nDims();
+    const int n_clusters = cluster.getCols();
+    const int n_tasks = static_cast<int>(_frontier.size());
+    _workspace.reset();
+    // one accumulator per task (double, as the nodes sums), reduced in a fixed order afterwards
+    double* task_sums = _workspace.allocZero<double>(static_cast<size_t>(n_tasks) * n_clusters * n_dims);
+    int* task_counts = _workspace.allocZero<int>(static_cast<size_t>(n_tasks) * n_clusters);
+    // candidates lists of each recursion level, per thread
+    const size_t scratch_size = static_cast<size_t>(n_clusters) * (_depth + 2);
+    int* scratches = _workspace.alloc<int>(_n_threads * scratch_size);
+
+    #pragma omp parallel num_threads(_n_threads)
+    {
+        int* scratch = scratches + omp_get_thread_num() * scratch_size;
+        #pragma omp for
+        for(int task = 0; task < n_tasks; ++task){
+            for(int c = 0; c < n_clusters; ++c) scratch[c] = c;
+            filterNode(data, cluster, _frontier[task], scratch, n_clusters, scratch+n_clusters,
+                       labels, task_sums + static_cast<size_t>(task)*n_clusters*n_dims,
+                       task_counts + static_cast<size_t>(task)*n_clusters);
+        }
+    }
+    for(int c = 0; c < n_clusters; ++c) counts[c] = 0;
+    for(int n = 0; n < n_clusters*n_dims; ++n){
+        double sum = 0;
+        for(int task = 0; task < n_tasks; ++task) sum += task_sums[static_cast<size_t>(task)*n_clusters*n_dims+n];
+        sums[n] = static_cast<T>(sum);
+    }
+    for(int task = 0; task < n_tasks; ++task){
+        for(int c = 0; c < n_clusters; ++c) counts[c] += task_counts[static_cast<size_t>(task)*n_clusters+c];
+    }
+}
+
+template<typename T, int D>
+void KDTree<T, D>::filterNode(const Matrix<T>& data, const Matrix<T>& cluster, int node,
+        const int* candidates, int n_candidates, int* scratch,
+        int* labels, double* sums, int* counts) const {
+    const int n_dims = nDims();
+    const int n_clusters = cluster.getCols();
+    const Node& current = _nodes[node];
+
+    // candidate closest to the cell's midpoint
+    int z_star = candidates[0];
+    T min_dist = std::numeric_limits<T>::max();
+    for(int n = 0; n < n_candidates; ++n){
+        T dist = 0;
+        for(int d = 0; d < n_dims; ++d){
+            T diff = (_box_min[node*n_dims+d] + _box_max[node*n_dims+d]) / 2 - cluster(d, candidates[n]);
+            dist += diff * diff;
+        }
+        if(dist < min_dist){
+            min_dist = dist;
+            z_star = candidates[n];
+        }
+    }
+    // candidates that may own a part of the cell (order kept: lowest index wins ties)
+    int n_kept = 0;
+    for(int n = 0; n < n_candidates; ++n){
+        if(candidates[n] == z_star || !isFarther(cluster, candidates[n], z_star, node)) scratch[n_kept++] = candidates[n];
+    }
+    if(n_kept == 1){
+        assignSubtree(node, z_star, n_clusters, labels, sums, counts);
+        return;
+    }
+    if(current.left < 0){
+        for(int m = current.from; m < current.to; ++m){
+            const T* point = _points.data() + static_cast<size_t>(m)*n_dims;
+            int k_index = scratch[0];
+            T best = SquaredL2<T>::template dist<D>(point, 1, cluster.begin()+k_index, n_clusters, n_dims);
+            for(int n = 1; n < n_kept; ++n){
+                T dist = SquaredL2<T>::template dist<D>(point, 1, cluster.begin()+scratch[n], n_clusters, n_dims);
+                if(dist < best){
+                    best = dist;
+                    k_index = scratch[n];
+                }
+            }
+            labels[m] = k_index;
+            ++counts[k_index];
+            for(int d = 0; d < n_dims; ++d) sums[k_index+d*n_clusters] += point[d];
+        }
+        return;
+    }
+    filterNode(data, cluster, current.left, scratch, n_kept, scratch+n_clusters, labels, sums, counts);
+    filterNode(data, cluster, current.right, scratch, n_kept, scratch+n_clusters, labels, sums, counts);
+}
+
+template<typename T, int D>
+void KDTree<T, D>::assignSubtree(int node, int k_index, int n_clusters, int* labels, double* sums, int* counts) const {
+    const int n_dims = nDims();
+    const Node& current = _nodes[node];
+    std::fill(labels + current.from, labels + current.to, k_index);
+    counts[k_index] += current.to - current.from;
+    for(int d = 0; d < n_dims; ++d) sums[k_index+d*n_clusters] += _node_sums[node*n_dims+d];
+}
+
+/**
+ * True if no point of the node's cell is closer to z than to z_star: the cell's
+ * vertex the furthest in the z - z_star direction is still strictly closer to z_star.
+*/
+template<typename T, int D>
+bool KDTree<T, D>::isFarther(const Matrix<T>& cluster, int z, int z_star, int node) const {
+    const int n_dims = nDims();
+    T dist_z = 0;
+    T dist_z_star = 0;
+    for(int d = 0; d < n_dims; ++d){
+        const T vertex = cluster(d, z) > cluster(d, z_star) ? _box_max[node*n_dims+d] : _box_min[node*n_dims+d];
+        const T diff_z = cluster(d, z) - vertex;
+        const T diff_z_star = cluster(d, z_star) - vertex;
+        dist_z += diff_z * diff_z;
+        dist_z_star += diff_z_star * diff_z_star;
+    }
+    return dist_z > dist_z_star;
+}
@@ -1,27 +1,140 @@
 #pragma once
 
+#include <array>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <thread>
+#include <cstdint>
+
 #include "headers/Matrix.h"
+#include "headers/TiledMatrix.h"
+#include "headers/Reduction.h"
+#include "headers/Update.h"
+#include "headers/Workspace.h"
+#include "headers/Transport.h"
 #include "ClosestCentroids.h"
+#include "Seeding.h"
 
-template<typename T>
+/**
+ * D: number of features if known at compile time (DYNAMIC_DIMS otherwise).
+ *    Small fixed D (2-8) lets every feature loop be unrolled.
+ * Metric: SquaredL2 (mean update), L1 (median update) or Cosine
+ *    (normalized mean update), see Metrics.h
+ * layout: TILED keeps a tiled copy of the dataset (headers/TiledMatrix.h) in place of
+ *    _training_set, read by the assignment and the mean update (one sequential sweep per
+ *    pass). LLOYD assign and mean (or normalized mean) update only. Pays off on wide
+ *    datasets, where the feature-major assignment reads N rows M samples apart: with
+ *    M N = 16M floats, K=16 (1 thread), assignment 17 vs 28 ms (N=64), 17 vs 32 ms
+ *    (N=128), update 20 vs 23 ms. For N=8 the assignment is ~15% slower (21 vs 18 ms,
+ *    M=2M) and the update faster (20 vs 27 ms): about even.
+ * precision: FP16/BF16 store the dataset in half precision (headers/Half.h) in place
+ *    of _training_set, distances and sums stay in T. LLOYD assign, FEATURE_MAJOR layout
+ *    and mean (or normalized mean) update only (asserted)
+ * seeding: initial centroids (see SeedEnum in Seeding.h), seed: seed of its random draws,
+ *    seed_params: settings of the seeding methods
+*/
+template<typename T, int D = DYNAMIC_DIMS, typename Metric = SquaredL2<T>>
 class KMeans{
 public:
-    KMeans(const Matrix<T>& dataset, int n_clusters, bool stop_criterion=true, int n_threads=1);
+    KMeans(const Matrix<T>& dataset, int n_clusters, bool stop_criterion=true, int n_threads=1, AssignEnum assign=LLOYD,
+           LayoutEnum layout=FEATURE_MAJOR, PrecisionEnum precision=FULL, SeedEnum seeding=UNIFORM_BOX, uint64_t seed=0,
+           SeedParams seed_params=SeedParams());
+    /**
+     * Same as above without copying the dataset.
+     * weights: optional M non negative samples weights (e.g. a coreset, see Coreset.h) used by
+     *    the seeding, the mean update and computeInertia. Not for MEDIAN metrics nor the FUSED
+     *    and KDTREE engines (they accumulate unweighted sums, asserted). The incremental update
+     *    is disabled.
+    */
+    KMeans(std::shared_ptr<const Matrix<T>> dataset, int n_clusters, bool stop_criterion=true, int n_threads=1, AssignEnum assign=LLOYD,
+           LayoutEnum layout=FEATURE_MAJOR, PrecisionEnum precision=FULL, SeedEnum seeding=UNIFORM_BOX, uint64_t seed=0,
+           SeedParams seed_params=SeedParams(), std::shared_ptr<const std::vector<T>> weights=nullptr);
 
-    Matrix<T> getCentroid();
-    Matrix<int> getDataToCentroid();
+    /**
+     * n_init restarts (seeds seed, seed+1, ...) trained concurrently over the shared
+     * dataset, returns the one of lowest computeInertia() (lowest seed on ties).
+     * min(n_init, n_threads) restarts run at a time and share the n_threads threads (the
+     * remainder of the division goes to the first ones). Feature-major layout and full precision (no per restart copy of the dataset).
+     * UNIFORM_BOX ignores the seed: use a seeded method to reproduce the result.
+    */
+    static std::unique_ptr<KMeans> bestOf(int n_init, std::shared_ptr<const Matrix<T>> dataset, int n_clusters, int max_iter,
+                                          float threashold=-1, int n_threads=1, AssignEnum assign=LLOYD, SeedEnum seeding=KMEANS_PP,
+                                          uint64_t seed=0, SeedParams seed_params=SeedParams());
+
+    const Matrix<T>& getCentroid() const;
+    const Matrix<int>& getDataToCentroid() const;
     int getNIters();
+    /**
+     * sum over the samples of the Metric::dist to their centroid at the last
+     * assignment (FUSED engine only, -1 otherwise)
+    */
+    double getInertia();
+    /**
+     * sum over the samples of the (weighted) Metric::dist to the current centroid of
+     * their cluster (one pass, same value whatever the number of threads)
+    */
+    double computeInertia() const;
 
     void mapSampleToCentroid();
     void updateCentroids();
+    void updateCentroidsMedian();
+    template<typename C>
+    void updateCentroidsFromSums(const T* sums, const C* counts);
     void run(int max_iter, float threashold=-1);
+    /**
+     * APPROXIMATE engine settings (see ClosestCentroids::setApproximation)
+    */
+    void setApproximation(int n_probes, int exact_period);
+    /**
+     * Incremental update: running clusters sums and sizes are only corrected
+     * for the samples whose label changed since the previous update. They are
+     * recomputed from scratch every refresh_period updates (bounds the rounding drift).
+     * Needs the previous mapping (stop_criterion/buffered), full update otherwise.
+    */
+    void setIncremental(bool incremental, int refresh_period=10);
+    /**
+     * Data-parallel mode: the dataset is this process' shard of the samples. Each
+     * update sums the clusters sums and sizes of every rank (ringAllreduce, K N + K + 2
+     * values per update) so all ranks compute the same centroids and stop at the same
+     * iteration. The centroids of rank 0 (seeded on its shard) are sent to the others.
+     * Mean or normalized mean update. computeInertia and getInertia stay per shard.
+    */
+    void setTransport(std::shared_ptr<Transport> transport);
 
     void print();
 
 
 private:
+    void accumulate(int from_i, int to_i, T* sums, int* counts) const;
+    /**
+     * scratch: n_dims values for the features of a sample (unused when D is fixed)
+    */
+    void accumulateMoved(int from_i, int to_i, T* sums, int* counts, T* scratch) const;
+    void accumulateWeighted(int from_i, int to_i, T* sums, T* totals, T* scratch) const;
+    void sample(int i, T* features) const;
+    /**
+     * mapping of the last assignment by sample index (KDTREE: labels expanded from the tree order)
+    */
+    const ClosestCentroids<T, D, Metric>& mapping() const;
+    /**
+     * updateCentroidsFromSums on the sums of every shard (data-parallel mode)
+     * or on the local ones
+    */
+    template<typename C>
+    void reduceAndUpdate(const T* sums, const C* counts);
+    /**
+     * labels changed by the last assignment (FUSED: counted by the assignment)
+    */
+    int changedLabels();
+
     bool _stop_crit;
     int _n_threads;
+    /**
+     * engine used by mapSampleToCentroid (see AssignEnum)
+    */
+    AssignEnum _assign;
     int _n_iters = 0;
     /**
      * number of features of the dataset (x0, x1, ..., xn)
@@ -47,8 +160,13 @@ private:
      * where:
      *      N: number of dimensions
      *      M: number of training samples 
+     * shared (read-only) with the caller and the other restarts (see bestOf)
+    */
+    std::shared_ptr<const Matrix<T>> _training_set;
+    /**
+     * samples weights (nullptr: unit weights)
     */
-    Matrix<T> _training_set;
+    std::shared_ptr<const std::vector<T>> _weights;
     /**
      * M centroids indices mapping each training sample to a
      * corresponding cluster. 1xM matrix
@@ -64,70 +182,485 @@ private:
      *      and check for changes.
      *      If almost no change -> stop algorithm
     */
-    std::unique_ptr<ClosestCentroids<T>> _dataset_to_centroids;
+    std::unique_ptr<ClosestCentroids<T, D, Metric>> _dataset_to_centroids;
+    /**
+     * kd-tree over _training_set (KDTREE engine only)
+    */
+    std::unique_ptr<KDTree<T, D>> _kdtree;
+    /**
+     * tiled copy of the dataset (TILED layout only), read by the LLOYD
+     * assignment and the mean update, _training_set is released once it is built
+    */
+    std::unique_ptr<TiledMatrix<T>> _tiled_set;
+    /**
+     * NxM half precision copy of the dataset (raw bits, FP16 or BF16 precision),
+     * _training_set is released once it is built
+    */
+    PrecisionEnum _precision;
+    std::unique_ptr<Matrix<uint16_t>> _half_set;
+    /**
+     * clusters sums (sums[c+d*K]) and sizes accumulated by the assignment
+     * step when the engine can (_accumulated set), updateCentroids then
+     * doesn't scan the samples again
+    */
+    std::vector<T> _cluster_sums;
+    std::vector<int> _cluster_counts;
+    bool _accumulated = false;
+    /**
+     * incremental update (see setIncremental): running sums and sizes
+     * w.r.t. the previous mapping, valid if _running_updates > 0
+    */
+    bool _incremental = false;
+    int _refresh_period = 10;
+    int _running_updates = 0;
+    std::vector<T> _running_sums;
+    std::vector<int> _running_counts;
+    /**
+     * scratch memory of the update step, sized in the constructor and
+     * reused by every iteration (no allocation in run() once warmed up)
+    */
+    Workspace _workspace;
+    // samples per block of the update step parts (see headers/Reduction.h)
+    static constexpr int _update_chunk = 1024;
+    /**
+     * statistics of the last FUSED assignment: labels changed w.r.t. the previous one, inertia
+    */
+    int _changed = 0;
+    double _inertia = -1;
+    /**
+     * data-parallel mode (see setTransport): sums, sizes, labels changed and
+     * samples of every shard, receive buffer of the allreduce, labels changes
+     * rate over every shard
+    */
+    std::shared_ptr<Transport> _transport;
+    std::vector<double> _shard_totals;
+    std::vector<double> _allreduce_scratch;
+    std::vector<T> _global_sums;
+    float _global_modif_rate = 1;
 };
 
-template<typename T>
-KMeans<T>::KMeans(const Matrix<T>& dataset, int n_clusters, bool stop_criterion, int n_threads) : 
-        _training_set{ dataset },
+template<typename T, int D, typename Metric>
+KMeans<T, D, Metric>::KMeans(const Matrix<T>& dataset, int n_clusters, bool stop_criterion, int n_threads, AssignEnum assign,
+                             LayoutEnum layout, PrecisionEnum precision, SeedEnum seeding, uint64_t seed,
+                             SeedParams seed_params) :
+        KMeans(std::make_shared<const Matrix<T>>(dataset), n_clusters, stop_criterion, n_threads, assign,
+               layout, precision, seeding, seed, seed_params) {}
+
+template<typename T, int D, typename Metric>
+KMeans<T, D, Metric>::KMeans(std::shared_ptr<const Matrix<T>> dataset, int n_clusters, bool stop_criterion, int n_threads, AssignEnum assign,
+                             LayoutEnum layout, PrecisionEnum precision, SeedEnum seeding, uint64_t seed,
+                             SeedParams seed_params, std::shared_ptr<const std::vector<T>> weights) : 
+        _training_set{ std::move(dataset) },
         _n_clusters{ n_clusters },
         _stop_crit{ stop_criterion },
-        _n_threads{ n_threads } {
+        _n_threads{ n_threads },
+        _assign{ assign },
+        _weights{ std::move(weights) } {
         
-    _training_set = dataset;
-    _dims = dataset.getRows();
-    _samples = dataset.getCols();
-    _training_set.setThreads(_n_threads);
+    assert(D == DYNAMIC_DIMS || D == _training_set->getRows());
+    _dims = D == DYNAMIC_DIMS ? _training_set->getRows() : D;
+    _samples = _training_set->getCols();
+    if(_weights){
+        assert(Metric::update != MEDIAN && static_cast<int>(_weights->size()) == _samples);
+        assert(_assign != FUSED && _assign != KDTREE);
+    }
        
-    Matrix<T> vMinValues = _training_set.vMin();
-    Matrix<T> vMaxValues = _training_set.vMax();
-
-    _centroids = std::make_unique<Matrix<T>>(_dims, n_clusters, UNIFORM, vMinValues, vMaxValues);
+    _centroids = seedCentroids<T, D, Metric>(*_training_set, n_clusters, seeding, seed, _n_threads, seed_params,
+                                             _weights ? _weights->data() : nullptr);
     _centroids->setThreads(_n_threads);
 
-    _dataset_to_centroids = std::make_unique<ClosestCentroids<T>>(_samples, 0, stop_criterion, _n_threads);
+    _dataset_to_centroids = std::make_unique<ClosestCentroids<T, D, Metric>>(_samples, 0, stop_criterion, _n_threads);
+    _precision = precision;
+    if(_precision != FULL){
+        assert(_assign == LLOYD && layout == FEATURE_MAJOR && Metric::update != MEDIAN);
+        _half_set = std::make_unique<Matrix<uint16_t>>(_dims, _samples, 0, _n_threads);
+        #pragma omp parallel for num_threads(_n_threads)
+        for(int d = 0; d < _dims; ++d){
+            if constexpr(std::is_same<T, float>::value) half::fromFloat(_training_set->rowBegin(d), _half_set->rowBegin(d), _samples, _precision);
+            else {
+                for(int i = 0; i < _samples; ++i) (*_half_set)(d, i) = half::fromFloat(static_cast<float>((*_training_set)(d, i)), _precision);
+            }
+        }
+        _training_set.reset();
+    }
+    if(layout == TILED){
+        assert(_assign == LLOYD && Metric::update != MEDIAN);
+        _tiled_set = std::make_unique<TiledMatrix<T>>(*_training_set, _n_threads);
+        _training_set.reset();
+    }
+
+    if constexpr(Metric::kd_filter){
+        if(_assign == KDTREE) _kdtree = std::make_unique<KDTree<T, D>>(*_training_set, 16, _n_threads);
+    }
+    if(_kdtree || _assign == FUSED){
+        _cluster_sums.resize(_n_clusters*_dims);
+        _cluster_counts.resize(_n_clusters);
+    }
+    // update step scratch: per part sums and sizes (mean) or samples bucketed by cluster (median)
+    const size_t n_parts = reduction::partsN(_samples, _update_chunk, 4*_n_clusters);
+    if(Metric::update == MEDIAN) _workspace.reserve((_n_clusters*2 + 1 + _samples) * sizeof(int) + _samples * sizeof(T) + 4*64);
+    else _workspace.reserve(n_parts * (_n_clusters*_dims*sizeof(T) + _n_clusters*sizeof(int)) + 2*64);
 }
 
-template<typename T>
-inline Matrix<T> KMeans<T>::getCentroid(){ return *_centroids; }
+template<typename T, int D, typename Metric>
+inline const Matrix<T>& KMeans<T, D, Metric>::getCentroid() const { return *_centroids; }
 
-template<typename T>
-inline Matrix<int> KMeans<T>::getDataToCentroid(){ return *static_cast<Matrix<int>* >(_dataset_to_centroids.get()); }
+template<typename T, int D, typename Metric>
+inline const Matrix<int>& KMeans<T, D, Metric>::getDataToCentroid() const { return mapping(); }
 
-template<typename T>
-inline int KMeans<T>::getNIters(){ return _n_iters; }
+template<typename T, int D, typename Metric>
+inline const ClosestCentroids<T, D, Metric>& KMeans<T, D, Metric>::mapping() const {
+    _dataset_to_centroids->expandLabels();
+    return *_dataset_to_centroids;
+}
 
-template<typename T>
-void KMeans<T>::mapSampleToCentroid(){ _dataset_to_centroids->getClosest(_training_set, *_centroids); }
+template<typename T, int D, typename Metric>
+inline int KMeans<T, D, Metric>::getNIters(){ return _n_iters; }
 
-template<typename T>
-void KMeans<T>::updateCentroids(){
-    // number of points assigned to a cluster
-    int occurences[_n_clusters] = {0};
-    // accumulates the samples to compute new cluster positions
-    T sample_buff[_n_clusters*_dims] = {0};
+template<typename T, int D, typename Metric>
+inline double KMeans<T, D, Metric>::getInertia(){ return _inertia; }
 
-    //#pragma omp parallel for num_threads(_n_threads)
-    for(int i = 0; i < _samples; ++i){
-        const int& k_index = (*_dataset_to_centroids)(i);
-        for(int d = 0; d < _dims; ++d){
-            //#pragma atomic read write
-            sample_buff[k_index+d*_n_clusters] += _training_set(d, i);
+template<typename T, int D, typename Metric>
+double KMeans<T, D, Metric>::computeInertia() const {
+    const int n_dims = D == DYNAMIC_DIMS ? _dims : D;
+    const int n_parts = reduction::partsN(_samples, _update_chunk);
+    std::vector<double> part_sums(n_parts);
+    const ClosestCentroids<T, D, Metric>& labels = mapping();
+
+    #pragma omp parallel for num_threads(_n_threads)
+    for(int part = 0; part < n_parts; ++part){
+        const int from_i = reduction::partBegin(part, n_parts, _samples, _update_chunk);
+        const int to_i = reduction::partBegin(part+1, n_parts, _samples, _update_chunk);
+        std::vector<T> features(n_dims);
+        double sum = 0;
+        for(int i = from_i; i < to_i; ++i){
+            sample(i, features.data());
+            const T dist = Metric::template dist<D>(features.data(), 1, _centroids->begin()+labels(i), _n_clusters, n_dims);
+            sum += _weights ? static_cast<double>((*_weights)[i]) * dist : dist;
+        }
+        part_sums[part] = sum;
+    }
+    double inertia = 0;
+    for(int part = 0; part < n_parts; ++part) inertia += part_sums[part];
+    return inertia;
+}
+
+template<typename T, int D, typename Metric>
+std::unique_ptr<KMeans<T, D, Metric>> KMeans<T, D, Metric>::bestOf(int n_init, std::shared_ptr<const Matrix<T>> dataset, int n_clusters,
+        int max_iter, float threashold, int n_threads, AssignEnum assign, SeedEnum seeding, uint64_t seed, SeedParams seed_params){
+    assert(n_init > 0);
+    // restarts run at a time, the threads left are used inside each one
+    const int n_groups = std::max(1, std::min(n_init, n_threads));
+
+    std::unique_ptr<KMeans> best;
+    double best_inertia = 0;
+    int best_restart = -1;
+    std::mutex best_mutex;
+    std::atomic<int> next_restart{ 0 };
+    auto worker = [&](int group){
+        const int inner_threads = std::max(1, n_threads / n_groups + (group < n_threads % n_groups));
+        for(int r = next_restart++; r < n_init; r = next_restart++){
+            auto restart = std::make_unique<KMeans>(dataset, n_clusters, true, inner_threads, assign,
+                                                    FEATURE_MAJOR, FULL, seeding, seed + r, seed_params);
+            restart->run(max_iter, threashold);
+            const double inertia = restart->computeInertia();
+            std::lock_guard<std::mutex> lock(best_mutex);
+            // same choice whatever the order the restarts finish in
+            if(!best || inertia < best_inertia || (inertia == best_inertia && r < best_restart)){
+                best = std::move(restart);
+                best_inertia = inertia;
+                best_restart = r;
+            }
+        }
+    };
+    std::vector<std::thread> group_threads;
+    for(int g = 1; g < n_groups; ++g) group_threads.emplace_back(worker, g);
+    worker(0);
+    for(std::thread& thread : group_threads) thread.join();
+    return best;
+}
+
+template<typename T, int D, typename Metric>
+void KMeans<T, D, Metric>::mapSampleToCentroid(){
+    switch(_assign){
+        case ELKAN:
+            _dataset_to_centroids->getClosestElkan(*_training_set, *_centroids);
+            break;
+        case HAMERLY:
+            _dataset_to_centroids->getClosestHamerly(*_training_set, *_centroids);
+            break;
+        case YINYANG:
+            _dataset_to_centroids->getClosestYinyang(*_training_set, *_centroids);
+            break;
+        case GEMM:
+            _dataset_to_centroids->getClosestGemm(*_training_set, *_centroids);
+            break;
+        case KDTREE:
+            if(_kdtree){
+                _dataset_to_centroids->getClosestFiltered(*_kdtree, *_training_set, *_centroids, _cluster_sums.data(), _cluster_counts.data());
+                _accumulated = true;
+                break;
+            }
+            _dataset_to_centroids->getClosest(*_training_set, *_centroids);
+            break;
+        case FUSED:
+            if constexpr(Metric::update != MEDIAN){
+                _dataset_to_centroids->getClosestFused(*_training_set, *_centroids, _cluster_sums.data(), _cluster_counts.data(), _changed, _inertia);
+                _accumulated = true;
+                break;
+            }
+            _dataset_to_centroids->getClosest(*_training_set, *_centroids);
+            break;
+        case BLOCKED:
+            _dataset_to_centroids->getClosestBlocked(*_training_set, *_centroids);
+            break;
+        case APPROXIMATE:
+            _dataset_to_centroids->getClosestApproximate(*_training_set, *_centroids);
+            break;
+        default:
+            if(_half_set) _dataset_to_centroids->getClosestHalf(*_half_set, _precision, *_centroids);
+            else if(_tiled_set) _dataset_to_centroids->getClosestTiled(*_tiled_set, *_centroids);
+            else _dataset_to_centroids->getClosest(*_training_set, *_centroids);
+            break;
+    }
+}
+
+template<typename T, int D, typename Metric>
+void KMeans<T, D, Metric>::updateCentroids(){
+    if constexpr(Metric::update == MEDIAN){
+        updateCentroidsMedian();
+        return;
+    }
+    if(_accumulated){
+        _accumulated = false;
+        // running sums (incremental update) no longer match the mapping
+        _running_updates = 0;
+        reduceAndUpdate(_cluster_sums.data(), _cluster_counts.data());
+        return;
+    }
+    // compile-time constant when D is specified
+    const int n_dims = D == DYNAMIC_DIMS ? _dims : D;
+    if(_weights){
+        // weighted sums and clusters weights, same parts as below
+        const int n_parts = reduction::partsN(_samples, _update_chunk, 4*_n_clusters);
+        const size_t sums_size = static_cast<size_t>(_n_clusters) * n_dims;
+        _workspace.reset();
+        T* part_sums = _workspace.allocZero<T>(n_parts * sums_size);
+        T* part_totals = _workspace.allocZero<T>(static_cast<size_t>(n_parts) * _n_clusters);
+        T* samples = _workspace.alloc<T>(static_cast<size_t>(_n_threads) * n_dims);
+
+        #pragma omp parallel for schedule(dynamic) num_threads(_n_threads)
+        for(int part = 0; part < n_parts; ++part){
+            const int from_i = reduction::partBegin(part, n_parts, _samples, _update_chunk);
+            const int to_i = reduction::partBegin(part+1, n_parts, _samples, _update_chunk);
+            accumulateWeighted(from_i, to_i, part_sums + part*sums_size, part_totals + static_cast<size_t>(part)*_n_clusters,
+                               samples + static_cast<size_t>(omp_get_thread_num()) * n_dims);
+        }
+        reduction::treeReduce(part_sums, n_parts, sums_size, _n_threads);
+        reduction::treeReduce(part_totals, n_parts, _n_clusters, _n_threads);
+        reduceAndUpdate(part_sums, part_totals);
+        return;
+    }
+    // only the samples that moved since the previous update are accumulated
+    // (removed from their previous cluster) on top of the running sums
+    const bool delta = _incremental && _running_updates > 0 && _running_updates % _refresh_period
+                       && _dataset_to_centroids->isBuffered();
+    // one accumulator per part (parts only depend on the number of samples),
+    // summed in a fixed order: same centroids whatever the number of threads
+    const int n_parts = reduction::partsN(_samples, _update_chunk, 4*_n_clusters);
+    const size_t sums_size = static_cast<size_t>(_n_clusters) * n_dims;
+    _workspace.reset();
+    T* part_sums = _workspace.allocZero<T>(n_parts * sums_size);
+    int* part_counts = _workspace.allocZero<int>(static_cast<size_t>(n_parts) * _n_clusters);
+    T* samples = delta ? _workspace.alloc<T>(static_cast<size_t>(_n_threads) * n_dims) : nullptr;
+
+    #pragma omp parallel for schedule(dynamic) num_threads(_n_threads)
+    for(int part = 0; part < n_parts; ++part){
+        const int from_i = reduction::partBegin(part, n_parts, _samples, _update_chunk);
+        const int to_i = reduction::partBegin(part+1, n_parts, _samples, _update_chunk);
+        if(delta) accumulateMoved(from_i, to_i, part_sums + part*sums_size, part_counts + static_cast<size_t>(part)*_n_clusters,
+                                  samples + static_cast<size_t>(omp_get_thread_num()) * n_dims);
+        else accumulate(from_i, to_i, part_sums + part*sums_size, part_counts + static_cast<size_t>(part)*_n_clusters);
+    }
+    reduction::treeReduce(part_sums, n_parts, sums_size, _n_threads);
+    reduction::treeReduce(part_counts, n_parts, _n_clusters, _n_threads);
+    if(!_incremental){
+        reduceAndUpdate(part_sums, part_counts);
+        return;
+    }
+    if(delta){
+        for(size_t n = 0; n < sums_size; ++n) _running_sums[n] += part_sums[n];
+        for(int c = 0; c < _n_clusters; ++c) _running_counts[c] += part_counts[c];
+    } else {
+        _running_sums.assign(part_sums, part_sums+sums_size);
+        _running_counts.assign(part_counts, part_counts+_n_clusters);
+    }
+    ++_running_updates;
+    reduceAndUpdate(_running_sums.data(), _running_counts.data());
+}
+
+/**
+ * Difference of the sums and sizes between the current and the previous mapping
+ * caused by the samples [from_i, to_i) that changed cluster
+*/
+template<typename T, int D, typename Metric>
+void KMeans<T, D, Metric>::accumulateMoved(int from_i, int to_i, T* sums, int* counts, T* scratch) const {
+    const int n_dims = D == DYNAMIC_DIMS ? _dims : D;
+    const ClosestCentroids<T, D, Metric>& labels = mapping();
+    std::array<T, D == DYNAMIC_DIMS ? 1 : D> fixed_features;
+    T* features = D == DYNAMIC_DIMS ? scratch : fixed_features.data();
+    for(int i = from_i; i < to_i; ++i){
+        const int k_index = labels(i);
+        const int k_prev = labels.previous(i);
+        if(k_index == k_prev) continue;
+        sample(i, features);
+        for(int d = 0; d < n_dims; ++d){
+            sums[k_index+d*_n_clusters] += features[d];
+            sums[k_prev+d*_n_clusters] -= features[d];
         }
-        //#pragma atomic write
-        ++occurences[k_index];
+        ++counts[k_index];
+        --counts[k_prev];
     }
-    //#pragma omp parallel for num_threads(_n_threads)
+}
+
+/**
+ * Adds the weighted samples [from_i, to_i) to the sums (sums[c+d*K]) and weights of their cluster
+*/
+template<typename T, int D, typename Metric>
+void KMeans<T, D, Metric>::accumulateWeighted(int from_i, int to_i, T* sums, T* totals, T* scratch) const {
+    const int n_dims = D == DYNAMIC_DIMS ? _dims : D;
+    const ClosestCentroids<T, D, Metric>& labels = mapping();
+    const T* weights = _weights->data();
+    std::array<T, D == DYNAMIC_DIMS ? 1 : D> fixed_features;
+    T* features = D == DYNAMIC_DIMS ? scratch : fixed_features.data();
+    for(int i = from_i; i < to_i; ++i){
+        const int k_index = labels(i);
+        sample(i, features);
+        for(int d = 0; d < n_dims; ++d) sums[k_index+d*_n_clusters] += weights[i] * features[d];
+        totals[k_index] += weights[i];
+    }
+}
+
+/**
+ * Features of sample i from whichever copy of the dataset is kept
+*/
+template<typename T, int D, typename Metric>
+void KMeans<T, D, Metric>::sample(int i, T* features) const {
+    const int n_dims = D == DYNAMIC_DIMS ? _dims : D;
+    for(int d = 0; d < n_dims; ++d){
+        if(_half_set) features[d] = static_cast<T>(half::toFloat((*_half_set)(d, i), _precision));
+        else if(_tiled_set) features[d] = (*_tiled_set)(d, i);
+        else features[d] = (*_training_set)(d, i);
+    }
+}
+
+/**
+ * Adds the samples [from_i, to_i) to the sums (sums[c+d*K]) and sizes of their cluster.
+ * Reads the dataset in whichever layout/precision it is kept.
+ * from_i is a multiple of _update_chunk (tiles and half precision chunks boundaries)
+*/
+template<typename T, int D, typename Metric>
+void KMeans<T, D, Metric>::accumulate(int from_i, int to_i, T* sums, int* counts) const {
+    const int n_dims = D == DYNAMIC_DIMS ? _dims : D;
+    const ClosestCentroids<T, D, Metric>& labels = mapping();
+    if(!_half_set && !_tiled_set){
+        update::accumulate(_training_set->begin(), _samples, n_dims, _n_clusters, labels.getLabels(), from_i, to_i, sums, counts);
+        return;
+    }
+    if(_half_set){
+        for(int i = from_i; i < to_i; ++i) ++counts[labels(i)];
+        // rows converted back by chunks, accumulated in T
+        T buffer[_update_chunk];
+        for(int from_chunk = from_i; from_chunk < to_i; from_chunk += _update_chunk){
+            const int n_samples = std::min(_update_chunk, to_i - from_chunk);
+            for(int d = 0; d < n_dims; ++d){
+                ClosestCentroids<T, D, Metric>::toT(_half_set->rowBegin(d) + from_chunk, buffer, n_samples, _precision);
+                for(int i = 0; i < n_samples; ++i) sums[labels(from_chunk+i)+d*_n_clusters] += buffer[i];
+            }
+        }
+        return;
+    }
+    // a tile is a NxW feature-major block of row stride W
+    constexpr int W = TiledMatrix<T>::tileWidth;
+    for(int t = from_i / W; t * W < to_i; ++t){
+        update::accumulate(_tiled_set->tile(t), W, n_dims, _n_clusters, labels.getLabels() + t*W, 0, std::min(W, to_i - t*W), sums, counts);
+    }
+}
+
+/**
+ * New centroids from the clusters sums (sums[c+d*K]) and sizes (or weights):
+ * mean (projected on the unit sphere for NORMALIZED_MEAN).
+ * Empty clusters keep their position.
+*/
+template<typename T, int D, typename Metric>
+template<typename C>
+void KMeans<T, D, Metric>::updateCentroidsFromSums(const T* sums, const C* counts){
+    update::meanUpdate(*_centroids, sums, counts, Metric::update == NORMALIZED_MEAN);
+}
+
+template<typename T, int D, typename Metric>
+template<typename C>
+void KMeans<T, D, Metric>::reduceAndUpdate(const T* sums, const C* counts){
+    if(!_transport){
+        updateCentroidsFromSums(sums, counts);
+        return;
+    }
+    const int n_dims = D == DYNAMIC_DIMS ? _dims : D;
+    const size_t sums_size = static_cast<size_t>(_n_clusters) * n_dims;
+    double* totals = _shard_totals.data();
+    std::copy(sums, sums+sums_size, totals);
+    std::copy(counts, counts+_n_clusters, totals+sums_size);
+    // labels changed and samples of the shard (exact counts)
+    totals[sums_size+_n_clusters] = changedLabels();
+    totals[sums_size+_n_clusters+1] = _samples;
+    ringAllreduce(*_transport, totals, _shard_totals.size(), _allreduce_scratch);
+
+    std::copy(totals, totals+sums_size, _global_sums.begin());
+    _global_modif_rate = static_cast<float>(totals[sums_size+_n_clusters] / totals[sums_size+_n_clusters+1]);
+    updateCentroidsFromSums(_global_sums.data(), totals+sums_size);
+}
+
+template<typename T, int D, typename Metric>
+inline int KMeans<T, D, Metric>::changedLabels(){
+    if(_assign == FUSED && Metric::update != MEDIAN) return _changed;
+    return _dataset_to_centroids->getChanged();
+}
+
+/**
+ * Feature-wise median of the samples of each cluster (minimizes the L1 cost).
+ * Samples indices are bucketed by cluster (counting sort) then each
+ * (cluster, feature) median is found with std::nth_element.
+*/
+template<typename T, int D, typename Metric>
+void KMeans<T, D, Metric>::updateCentroidsMedian(){
+    const int n_dims = D == DYNAMIC_DIMS ? _dims : D;
+    _workspace.reset();
+    const ClosestCentroids<T, D, Metric>& labels = mapping();
+    int* offsets = _workspace.allocZero<int>(_n_clusters+1);
+    for(int i = 0; i < _samples; ++i) ++offsets[labels(i)+1];
+    for(int c = 0; c < _n_clusters; ++c) offsets[c+1] += offsets[c];
+    int* members = _workspace.alloc<int>(_samples);
+    int* cursor = _workspace.alloc<int>(_n_clusters);
+    std::copy(offsets, offsets+_n_clusters, cursor);
+    for(int i = 0; i < _samples; ++i) members[cursor[labels(i)]++] = i;
+
+    T* values = _workspace.alloc<T>(_samples);
+    #pragma omp parallel for num_threads(_n_threads)
     for(int c = 0; c < _n_clusters; ++c){
-        if(!occurences[c]) continue;
-        for(int d = 0; d < _dims; ++d){
-            (*_centroids)(d, c) = sample_buff[c+d*_n_clusters] / occurences[c];
+        const int from = offsets[c];
+        const int count = offsets[c+1] - from;
+        if(!count) continue;
+        T* cluster_values = values + from;
+        for(int d = 0; d < n_dims; ++d){
+            for(int m = 0; m < count; ++m) cluster_values[m] = (*_training_set)(d, members[from+m]);
+            std::nth_element(cluster_values, cluster_values + count/2, cluster_values + count);
+            (*_centroids)(d, c) = cluster_values[count/2];
         }
     }
 }
 
-template<typename T>
-void KMeans<T>::run(int max_iter, float threashold){
+template<typename T, int D, typename Metric>
+void KMeans<T, D, Metric>::run(int max_iter, float threashold){
 
     mapSampleToCentroid();
     updateCentroids();
@@ -140,7 +673,8 @@ void KMeans<T>::run(int max_iter, float threashold){
     do {
         mapSampleToCentroid();
         updateCentroids();
-        modif_rate_curr = _dataset_to_centroids->getModifRate();
+        if(_transport) modif_rate_curr = _global_modif_rate;
+        else modif_rate_curr = static_cast<float>(changedLabels()) / _samples;
         inertia = modif_rate_curr - modif_rate_prev;
         modif_rate_prev = modif_rate_curr;
         //printf("%.3f %.3f\n", modif_rate_curr, inertia);
@@ -152,8 +686,36 @@ void KMeans<T>::run(int max_iter, float threashold){
     //printf("iter number: %d\n", epoch);
 }
 
-template<typename T>
-void KMeans<T>::print() {
+template<typename T, int D, typename Metric>
+void KMeans<T, D, Metric>::setApproximation(int n_probes, int exact_period){
+    _dataset_to_centroids->setApproximation(n_probes, exact_period);
+}
+
+template<typename T, int D, typename Metric>
+void KMeans<T, D, Metric>::setIncremental(bool incremental, int refresh_period){
+    _incremental = incremental;
+    _refresh_period = std::max(1, refresh_period);
+    _running_updates = 0;
+}
+
+template<typename T, int D, typename Metric>
+void KMeans<T, D, Metric>::setTransport(std::shared_ptr<Transport> transport){
+    static_assert(Metric::update != MEDIAN, "data-parallel KMeans: mean or normalized mean update only");
+    _transport = std::move(transport);
+    const size_t sums_size = static_cast<size_t>(_n_clusters) * _dims;
+    _shard_totals.assign(sums_size + _n_clusters + 2, 0);
+    _global_sums.resize(sums_size);
+    // running sums are per shard: summed at every update like the full ones
+    _running_updates = 0;
+
+    // broadcast of the centroids of rank 0 (the others add zeros)
+    if(_transport->getRank() == 0) std::copy(_centroids->begin(), _centroids->begin()+sums_size, _shard_totals.begin());
+    ringAllreduce(*_transport, _shard_totals.data(), sums_size, _allreduce_scratch);
+    for(size_t n = 0; n < sums_size; ++n) _centroids->begin()[n] = static_cast<T>(_shard_totals[n]);
+}
+
+template<typename T, int D, typename Metric>
+void KMeans<T, D, Metric>::print() {
     for(int d = 0; d < _dims; ++d){
         std::cout << "[";
         std::cout << _centroids->row(d) << "]," << std::endl;
@@ -0,0 +1,167 @@
+#pragma once
+
+#include <cmath>
+#include <limits>
+
+#include "headers/SIMDKernels.h"
+
+/**
+ * Centroid update rule that minimizes the within cluster cost of a metric
+ *      MEAN: arithmetic mean (squared euclidean)
+ *      MEDIAN: feature-wise median (L1)
+ *      NORMALIZED_MEAN: mean projected on the unit sphere (cosine)
+*/
+enum UpdateEnum { MEAN, MEDIAN, NORMALIZED_MEAN };
+
+/**
+ * Value of the D template parameter when the number of features
+ * is only known at runtime (number of rows of the dataset)
+*/
+constexpr int DYNAMIC_DIMS = 0;
+
+/**
+ * Metric policies used as template parameter of KMeans and ClosestCentroids.
+ * Each one provides:
+ *      dist<D>(x, x_stride, c, c_stride, n_dims): value minimized by the assignment.
+ *          feature d of x at x[d*x_stride] (idem for c). D: compile-time n_dims or 0
+ *      metric<D>(...): same arguments, a distance satisfying the triangle inequality and
+ *          monotone w.r.t. dist so the bound based engines (Elkan, Hamerly, Yinyang) stay exact
+ *      update: centroid update consistent with the metric
+ *      vectorized/kernel: whether headers/SIMDKernels.h has a kernel for it
+ *          metricOfDist(dist): metric from dist (vectorized metrics only), the bound based
+ *              engines get dist from the kernels and only convert what their bounds need
+ *      kd_filter: the kd-tree filtering pruning test is exact for this metric (KDTREE engine)
+ *      dot_based: the distance can be written with x.c products (GEMM engine)
+ *          gemmEpilogue(||c||^2, offset, scale): the GEMM engine minimizes offset + scale x.c
+ *              (an increasing function of dist for a given x)
+ *          gemmTolerance(||x||^2, max ||c||^2, n_dims): bound on the rounding error of the
+ *              difference of two epilogue values w.r.t. the difference of their dist. Closer
+ *              epilogue values are a near tie, decided by dist itself
+*/
+
+/**
+ * ||x - c||^2 (standard k-means)
+*/
+template<typename T>
+struct SquaredL2 {
+    static constexpr UpdateEnum update = MEAN;
+    static constexpr bool vectorized = true;
+    static constexpr simd::KernelEnum kernel = simd::SQ_L2_KERNEL;
+    static constexpr bool kd_filter = true;
+    static constexpr bool dot_based = true;
+
+    template<int D>
+    static inline T dist(const T* x, int x_stride, const T* c, int c_stride, int n_dims){
+        if(D) n_dims = D;
+        T acc = 0;
+        for(int d = 0; d < n_dims; ++d){
+            T diff = x[d*x_stride] - c[d*c_stride];
+            acc += diff * diff;
+        }
+        return acc;
+    }
+    template<int D>
+    static inline T metric(const T* x, int x_stride, const T* c, int c_stride, int n_dims){
+        return std::sqrt(dist<D>(x, x_stride, c, c_stride, n_dims));
+    }
+    static inline T metricOfDist(T dist){ return std::sqrt(dist); }
+
+    // ||x||^2 is the same for every centroid: ||c||^2 - 2x.c
+    static inline void gemmEpilogue(T cluster_norm, T& offset, T& scale){
+        offset = cluster_norm;
+        scale = -2;
+    }
+    static inline T gemmTolerance(T sample_norm, T max_cluster_norm, int n_dims){
+        return 16 * (n_dims + 2) * std::numeric_limits<T>::epsilon() * (sample_norm + max_cluster_norm);
+    }
+};
+
+/**
+ * sum |x_d - c_d| (k-medians)
+*/
+template<typename T>
+struct L1 {
+    static constexpr UpdateEnum update = MEDIAN;
+    static constexpr bool vectorized = true;
+    static constexpr simd::KernelEnum kernel = simd::L1_KERNEL;
+    static constexpr bool kd_filter = false;
+    static constexpr bool dot_based = false;
+
+    template<int D>
+    static inline T dist(const T* x, int x_stride, const T* c, int c_stride, int n_dims){
+        if(D) n_dims = D;
+        T acc = 0;
+        for(int d = 0; d < n_dims; ++d){
+            acc += std::abs(x[d*x_stride] - c[d*c_stride]);
+        }
+        return acc;
+    }
+    template<int D>
+    static inline T metric(const T* x, int x_stride, const T* c, int c_stride, int n_dims){
+        return dist<D>(x, x_stride, c, c_stride, n_dims);
+    }
+    static inline T metricOfDist(T dist){ return dist; }
+
+    static inline void gemmEpilogue(T, T& offset, T& scale){ offset = scale = 0; }
+    static inline T gemmTolerance(T, T, int){ return 0; }
+};
+
+/**
+ * 1 - x.c / (||x|| ||c||) (spherical k-means). Null vectors are at distance 1 of everything.
+ * metric is the euclidean distance between the normalized vectors, sqrt(2 dist),
+ * computed from the normalized differences (1 - cos loses too much precision near 0)
+*/
+template<typename T>
+struct Cosine {
+    static constexpr UpdateEnum update = NORMALIZED_MEAN;
+    static constexpr bool vectorized = false;
+    static constexpr simd::KernelEnum kernel = simd::SQ_L2_KERNEL;
+    static constexpr bool kd_filter = false;
+    static constexpr bool dot_based = true;
+
+    template<int D>
+    static inline T dist(const T* x, int x_stride, const T* c, int c_stride, int n_dims){
+        if(D) n_dims = D;
+        T dot = 0;
+        T x_norm = 0;
+        T c_norm = 0;
+        for(int d = 0; d < n_dims; ++d){
+            const T x_d = x[d*x_stride];
+            const T c_d = c[d*c_stride];
+            dot += x_d * c_d;
+            x_norm += x_d * x_d;
+            c_norm += c_d * c_d;
+        }
+        const T norms = std::sqrt(x_norm * c_norm);
+        return norms > 0 ? 1 - dot / norms : 1;
+    }
+    template<int D>
+    static inline T metric(const T* x, int x_stride, const T* c, int c_stride, int n_dims){
+        if(D) n_dims = D;
+        T x_norm = 0;
+        T c_norm = 0;
+        for(int d = 0; d < n_dims; ++d){
+            x_norm += x[d*x_stride] * x[d*x_stride];
+            c_norm += c[d*c_stride] * c[d*c_stride];
+        }
+        // null vectors: sqrt(2 * 1)
+        if(x_norm <= 0 || c_norm <= 0) return std::sqrt(static_cast<T>(2));
+        x_norm = 1 / std::sqrt(x_norm);
+        c_norm = 1 / std::sqrt(c_norm);
+        T acc = 0;
+        for(int d = 0; d < n_dims; ++d){
+            T diff = x[d*x_stride] * x_norm - c[d*c_stride] * c_norm;
+            acc += diff * diff;
+        }
+        return std::sqrt(acc);
+    }
+
+    // ||x|| is the same for every centroid: -x.c/||c|| (0 for a null centroid)
+    static inline void gemmEpilogue(T cluster_norm, T& offset, T& scale){
+        offset = 0;
+        scale = cluster_norm > 0 ? -1 / std::sqrt(cluster_norm) : 0;
+    }
+    static inline T gemmTolerance(T sample_norm, T, int n_dims){
+        return 16 * (n_dims + 4) * std::numeric_limits<T>::epsilon() * std::sqrt(sample_norm);
+    }
+};
@@ -0,0 +1,257 @@
+#pragma once
+
+#include <vector>
+#include <memory>
+#include <random>
+#include <limits>
+#include <cstdint>
+#include <algorithm>
+
+#include "headers/Matrix.h"
+#include "headers/Reduction.h"
+#include "headers/Update.h"
+#include "headers/Workspace.h"
+#include "ClosestCentroids.h"
+#include "Seeding.h"
+
+/**
+ * Mini-batch k-means (Sculley, Web-scale k-means clustering): each iteration
+ * draws batch_size samples (with replacement) from the NxM dataset, maps them
+ * with the ClosestCentroids kernels and moves every centroid towards the mean of
+ * its batch samples with a per centroid learning rate batch count / samples seen
+ * so far (the running mean of every sample it has been given).
+ * The seeding runs on a random subset of max(3 batch_size, 3 K) samples.
+ * D: number of features if known at compile time (DYNAMIC_DIMS otherwise)
+ * Metric: mean (SquaredL2) or normalized mean (Cosine) update
+*/
+template<typename T, int D = DYNAMIC_DIMS, typename Metric = SquaredL2<T>>
+class MiniBatchKMeans{
+public:
+    MiniBatchKMeans(const Matrix<T>& dataset, int n_clusters, int batch_size=1024, int n_threads=1,
+                    SeedEnum seeding=KMEANS_PP, uint64_t seed=0, SeedParams seed_params=SeedParams());
+    /**
+     * Same as above without copying the dataset
+    */
+    MiniBatchKMeans(std::shared_ptr<const Matrix<T>> dataset, int n_clusters, int batch_size=1024, int n_threads=1,
+                    SeedEnum seeding=KMEANS_PP, uint64_t seed=0, SeedParams seed_params=SeedParams());
+
+    const Matrix<T>& getCentroid() const;
+    /**
+     * mapping of the whole dataset computed by mapSampleToCentroid
+    */
+    const Matrix<int>& getDataToCentroid() const;
+    int getNIters();
+    /**
+     * smoothed (exponentially weighted) mean Metric::dist of the batch samples to their centroid
+    */
+    double getInertia();
+
+    /**
+     * One iteration: draws a batch, maps it and updates the centroids
+    */
+    void step();
+    /**
+     * At most max_iter batches. Early stopping on either
+     *      tol: smoothed mean squared centroids movement below tol times the mean
+     *           feature variance (0 to disable)
+     *      max_no_improvement: the smoothed batch inertia didn't improve for that
+     *           many batches in a row (0 to disable)
+    */
+    void run(int max_iter, double tol=0, int max_no_improvement=10);
+    /**
+     * Maps the whole dataset (one pass) to the current centroids
+    */
+    void mapSampleToCentroid();
+
+    void print();
+
+private:
+    void sampleBatch();
+    void updateCentroids();
+
+    int _n_threads;
+    int _n_iters = 0;
+    int _dims;
+    int _samples;
+    int _n_clusters;
+    int _batch_size;
+    std::mt19937_64 _rng;
+    std::shared_ptr<const Matrix<T>> _training_set;
+    /**
+     * NxK centroids
+    */
+    std::unique_ptr<Matrix<T>> _centroids;
+    /**
+     * samples of the current batch (Nxbatch_size, feature-major) and their mapping
+    */
+    Matrix<T> _batch;
+    std::vector<int> _batch_indices;
+    std::unique_ptr<ClosestCentroids<T, D, Metric>> _batch_to_centroids;
+    /**
+     * samples given to each centroid since the seeding (learning rates)
+    */
+    std::vector<int64_t> _seen;
+    /**
+     * mapping of the whole dataset (mapSampleToCentroid only)
+    */
+    std::unique_ptr<ClosestCentroids<T, D, Metric>> _dataset_to_centroids;
+    /**
+     * early stopping statistics: smoothing factor, smoothed batch inertia and
+     * centroids movement of the last step, mean feature variance of the seeding subset
+    */
+    double _alpha;
+    double _ewa_inertia = -1;
+    double _ewa_movement = -1;
+    double _movement = 0;
+    double _variance = 0;
+    Workspace _workspace;
+    // longest smoothing window of the early stopping statistics (batches)
+    static constexpr int _max_window = 100;
+    // batch samples per part of the update sums
+    static constexpr int _update_chunk = 256;
+};
+
+template<typename T, int D, typename Metric>
+MiniBatchKMeans<T, D, Metric>::MiniBatchKMeans(const Matrix<T>& dataset, int n_clusters, int batch_size, int n_threads,
+                                               SeedEnum seeding, uint64_t seed, SeedParams seed_params) :
+        MiniBatchKMeans(std::make_shared<const Matrix<T>>(dataset), n_clusters, batch_size, n_threads,
+                        seeding, seed, seed_params) {}
+
+template<typename T, int D, typename Metric>
+MiniBatchKMeans<T, D, Metric>::MiniBatchKMeans(std::shared_ptr<const Matrix<T>> dataset, int n_clusters, int batch_size, int n_threads,
+                                               SeedEnum seeding, uint64_t seed, SeedParams seed_params) :
+        _n_threads{ n_threads },
+        _n_clusters{ n_clusters },
+        _batch_size{ batch_size },
+        _rng{ seed },
+        _training_set{ std::move(dataset) },
+        _batch(_training_set->getRows(), batch_size, 0, n_threads),
+        _batch_indices(batch_size),
+        _seen(n_clusters, 0) {
+
+    static_assert(Metric::update != MEDIAN, "MiniBatchKMeans: mean or normalized mean update only");
+    assert(D == DYNAMIC_DIMS || D == _training_set->getRows());
+    _dims = D == DYNAMIC_DIMS ? _training_set->getRows() : D;
+    _samples = _training_set->getCols();
+    // about an epoch worth of batches, at most _max_window of them
+    _alpha = std::min(1.0, std::max(2.0 * batch_size / (_samples + 1), 2.0 / (_max_window + 1)));
+    _batch_to_centroids = std::make_unique<ClosestCentroids<T, D, Metric>>(batch_size, 0, false, _n_threads);
+
+    // seeding subset
+    const int init_size = std::min(_samples, std::max(3*batch_size, 3*n_clusters));
+    std::uniform_int_distribution<int> uniform_index(0, _samples-1);
+    Matrix<T> init_set(_dims, init_size, 0, _n_threads);
+    for(int j = 0; j < init_size; ++j){
+        const int i = uniform_index(_rng);
+        for(int d = 0; d < _dims; ++d) init_set(d, j) = (*_training_set)(d, i);
+    }
+    for(int d = 0; d < _dims; ++d){
+        double mean = 0, sq = 0;
+        for(int j = 0; j < init_size; ++j){
+            mean += init_set(d, j);
+            sq += static_cast<double>(init_set(d, j)) * init_set(d, j);
+        }
+        mean /= init_size;
+        _variance += sq / init_size - mean * mean;
+    }
+    _variance /= _dims;
+
+    _centroids = seedCentroids<T, D, Metric>(init_set, n_clusters, seeding, _rng(), _n_threads, seed_params);
+    _centroids->setThreads(_n_threads);
+
+    const int n_parts = reduction::partsN(_batch_size, _update_chunk, 4*_n_clusters);
+    _workspace.reserve(n_parts * (_n_clusters*_dims*sizeof(T) + _n_clusters*sizeof(int) + sizeof(double)) + 3*64);
+}
+
+template<typename T, int D, typename Metric>
+inline const Matrix<T>& MiniBatchKMeans<T, D, Metric>::getCentroid() const { return *_centroids; }
+
+template<typename T, int D, typename Metric>
+inline const Matrix<int>& MiniBatchKMeans<T, D, Metric>::getDataToCentroid() const {
+    assert(_dataset_to_centroids);
+    return *static_cast<Matrix<int>* >(_dataset_to_centroids.get());
+}
+
+template<typename T, int D, typename Metric>
+inline int MiniBatchKMeans<T, D, Metric>::getNIters(){ return _n_iters; }
+
+template<typename T, int D, typename Metric>
+inline double MiniBatchKMeans<T, D, Metric>::getInertia(){ return _ewa_inertia; }
+
+template<typename T, int D, typename Metric>
+void MiniBatchKMeans<T, D, Metric>::step(){
+    sampleBatch();
+    _batch_to_centroids->getClosest(_batch, *_centroids);
+
+    const T* dist = _batch_to_centroids->getDistances();
+    double inertia = 0;
+    for(int j = 0; j < _batch_size; ++j) inertia += dist[j];
+    inertia /= _batch_size;
+    _ewa_inertia = _ewa_inertia < 0 ? inertia : _alpha * inertia + (1 - _alpha) * _ewa_inertia;
+
+    updateCentroids();
+    _ewa_movement = _ewa_movement < 0 ? _movement : _alpha * _movement + (1 - _alpha) * _ewa_movement;
+    ++_n_iters;
+}
+
+template<typename T, int D, typename Metric>
+void MiniBatchKMeans<T, D, Metric>::run(int max_iter, double tol, int max_no_improvement){
+    double best_inertia = std::numeric_limits<double>::max();
+    int no_improvement = 0;
+    for(int iter = 0; iter < max_iter; ++iter){
+        step();
+        if(tol > 0 && _ewa_movement <= tol * _variance) break;
+        if(_ewa_inertia < best_inertia){
+            best_inertia = _ewa_inertia;
+            no_improvement = 0;
+        } else if(max_no_improvement > 0 && ++no_improvement >= max_no_improvement) break;
+    }
+}
+
+template<typename T, int D, typename Metric>
+void MiniBatchKMeans<T, D, Metric>::mapSampleToCentroid(){
+    if(!_dataset_to_centroids) _dataset_to_centroids = std::make_unique<ClosestCentroids<T, D, Metric>>(_samples, 0, false, _n_threads);
+    _dataset_to_centroids->getClosest(*_training_set, *_centroids);
+}
+
+/**
+ * Draws the batch indices (sequentially: same batches whatever the number of threads)
+ * and gathers the samples in the feature-major _batch
+*/
+template<typename T, int D, typename Metric>
+void MiniBatchKMeans<T, D, Metric>::sampleBatch(){
+    std::uniform_int_distribution<int> uniform_index(0, _samples-1);
+    for(int j = 0; j < _batch_size; ++j) _batch_indices[j] = uniform_index(_rng);
+
+    const int n_dims = D == DYNAMIC_DIMS ? _dims : D;
+    #pragma omp parallel for num_threads(_n_threads)
+    for(int j = 0; j < _batch_size; ++j){
+        for(int d = 0; d < n_dims; ++d) _batch(d, j) = (*_training_set)(d, _batch_indices[j]);
+    }
+}
+
+/**
+ * Batch sums and sizes (deterministic parts, see headers/Update.h), then every
+ * centroid with batch samples becomes the running mean of the samples it was given:
+ * c += (sum - count c) / seen
+*/
+template<typename T, int D, typename Metric>
+void MiniBatchKMeans<T, D, Metric>::updateCentroids(){
+    const int n_dims = D == DYNAMIC_DIMS ? _dims : D;
+    _workspace.reset();
+    const update::ClusterSums<T> batch = update::clusterSums(_batch.begin(), _batch_size, _batch_size, n_dims, _n_clusters,
+                                                             _batch_to_centroids->getLabels(), _update_chunk, _n_threads, _workspace);
+    // samples seen before this batch: weight of the current position
+    int64_t* past = _workspace.alloc<int64_t>(_n_clusters);
+    std::copy(_seen.begin(), _seen.end(), past);
+    for(int c = 0; c < _n_clusters; ++c) _seen[c] += batch.counts[c];
+    _movement = update::meanUpdate(*_centroids, batch.sums, batch.counts, Metric::update == NORMALIZED_MEAN, past) / _n_clusters;
+}
+
+template<typename T, int D, typename Metric>
+void MiniBatchKMeans<T, D, Metric>::print(){
+    for(int d = 0; d < _dims; ++d){
+        std::cout << "[";
+        std::cout << _centroids->row(d) << "]," << std::endl;
+    }
+}
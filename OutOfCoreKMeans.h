@@ -0,0 +1,241 @@
+#pragma once
+
+#include <vector>
+#include <memory>
+#include <random>
+#include <string>
+#include <future>
+#include <cstdint>
+#include <algorithm>
+
+#include "headers/Matrix.h"
+#include "headers/Reduction.h"
+#include "headers/Update.h"
+#include "headers/Workspace.h"
+#include "headers/BinaryFile.h"
+#include "ClosestCentroids.h"
+#include "Seeding.h"
+
+/**
+ * Lloyd iterations over a dataset kept on disk (headers/BinaryFile.h):
+ * every iteration streams the file by chunks of chunk_samples samples, maps each
+ * chunk with the ClosestCentroids kernels and adds its clusters sums and sizes to
+ * the iteration totals, then updates the centroids. While a chunk is processed the
+ * next one is read and transposed by a prefetch thread, hiding the I/O (the last
+ * chunk overlaps the read of the first chunk of the next pass).
+ * Memory: 2 chunks and their mapping buffers plus O(K N), whatever the file size.
+ * The centroids are seeded on max(3 K, 65536) samples read at random positions
+ * (capped to the dataset size), in increasing order.
+ * D: number of features if known at compile time (DYNAMIC_DIMS otherwise)
+ * Metric: mean (SquaredL2) or normalized mean (Cosine) update
+*/
+template<typename T, int D = DYNAMIC_DIMS, typename Metric = SquaredL2<T>>
+class OutOfCoreKMeans{
+public:
+    OutOfCoreKMeans(const std::string& path, int n_clusters, int chunk_samples=1 << 20, int n_threads=1,
+                    SeedEnum seeding=KMEANS_PP, uint64_t seed=0, SeedParams seed_params=SeedParams());
+
+    const Matrix<T>& getCentroid() const;
+    int getNIters();
+    /**
+     * sum over the samples of the Metric::dist to their centroid at the last pass
+    */
+    double getInertia();
+
+    /**
+     * One pass over the file: mapping and centroids update
+    */
+    void step();
+    /**
+     * At most max_iter passes, stops when the inertia decreased by less than
+     * threashold (relative) during the last pass
+    */
+    void run(int max_iter, float threashold=-1);
+
+    void print();
+
+private:
+    void initCentroids(SeedEnum seeding, uint64_t seed, SeedParams seed_params);
+    int chunkSize(int64_t c) const;
+    /**
+     * Reads chunk c (in background) into _chunks[_next], which then flips
+    */
+    void prefetch(int64_t c);
+    /**
+     * Maps the first n_chunk samples of the chunk and adds their sums and sizes to _sums / _counts
+    */
+    void accumulateChunk(const Matrix<T>& chunk, int n_chunk);
+    void updateCentroids();
+
+    BinaryFile<T> _file;
+    int _n_threads;
+    int _n_iters = 0;
+    int _dims;
+    int64_t _samples;
+    int _n_clusters;
+    int _chunk_samples;
+    /**
+     * NxK centroids
+    */
+    std::unique_ptr<Matrix<T>> _centroids;
+    /**
+     * chunks being processed / prefetched, both Nxchunk_samples (the last chunk of the
+     * file fills the first columns), and the buffer the next read goes to
+    */
+    Matrix<T> _chunks[2];
+    int _next = 0;
+    /**
+     * mapping of a full chunk and of the last (shorter) one
+    */
+    std::unique_ptr<ClosestCentroids<T, D, Metric>> _chunk_to_centroids;
+    std::unique_ptr<ClosestCentroids<T, D, Metric>> _tail_to_centroids;
+    /**
+     * read in flight (the next chunk, or the first one of the next pass), after
+     * the buffers and the file it uses: waited for before they are destroyed
+    */
+    std::future<void> _prefetch;
+    /**
+     * totals of the current pass (chunks added in file order)
+    */
+    std::vector<double> _sums;
+    std::vector<int64_t> _counts;
+    double _inertia = -1;
+    Workspace _workspace;
+    // samples of the seeding subset (at least 3 K)
+    static constexpr int _init_samples = 1 << 16;
+    // chunk samples per part of the update sums
+    static constexpr int _update_chunk = 1024;
+};
+
+template<typename T, int D, typename Metric>
+OutOfCoreKMeans<T, D, Metric>::OutOfCoreKMeans(const std::string& path, int n_clusters, int chunk_samples, int n_threads,
+                                               SeedEnum seeding, uint64_t seed, SeedParams seed_params) :
+        _file(path),
+        _n_threads{ n_threads },
+        _n_clusters{ n_clusters },
+        _chunk_samples{ chunk_samples } {
+
+    static_assert(Metric::update != MEDIAN, "OutOfCoreKMeans: mean or normalized mean update only");
+    assert(D == DYNAMIC_DIMS || D == _file.getFeatures());
+    _dims = D == DYNAMIC_DIMS ? _file.getFeatures() : D;
+    _samples = _file.getSamples();
+    _chunk_samples = static_cast<int>(std::min<int64_t>(_chunk_samples, _samples));
+    _sums.resize(static_cast<size_t>(_n_clusters) * _dims);
+    _counts.resize(_n_clusters);
+    initCentroids(seeding, seed, seed_params);
+
+    for(Matrix<T>& chunk : _chunks) chunk = Matrix<T>(_dims, _chunk_samples, 0);
+    _chunk_to_centroids = std::make_unique<ClosestCentroids<T, D, Metric>>(_chunk_samples, 0, false, _n_threads);
+    const int tail_samples = static_cast<int>(_samples % _chunk_samples);
+    if(tail_samples) _tail_to_centroids = std::make_unique<ClosestCentroids<T, D, Metric>>(tail_samples, 0, false, _n_threads);
+
+    const int n_parts = reduction::partsN(_chunk_samples, _update_chunk, 4*_n_clusters);
+    _workspace.reserve(n_parts * (_n_clusters*_dims*sizeof(T) + _n_clusters*sizeof(int) + sizeof(double)) + 3*64);
+}
+
+template<typename T, int D, typename Metric>
+void OutOfCoreKMeans<T, D, Metric>::initCentroids(SeedEnum seeding, uint64_t seed, SeedParams seed_params){
+    std::mt19937_64 rng(seed);
+    const int init_size = static_cast<int>(std::min<int64_t>(_samples, std::max(3*_n_clusters, _init_samples)));
+    // sorted positions: the file is read forward
+    std::uniform_int_distribution<int64_t> uniform_index(0, _samples-1);
+    std::vector<int64_t> indices(init_size);
+    for(int64_t& i : indices) i = uniform_index(rng);
+    std::sort(indices.begin(), indices.end());
+
+    Matrix<T> init_set(_dims, init_size, 0, _n_threads);
+    Matrix<T> sample(_dims, 1, 0);
+    for(int j = 0; j < init_size; ++j){
+        _file.read(indices[j], 1, sample);
+        for(int d = 0; d < _dims; ++d) init_set(d, j) = sample(d, 0);
+    }
+    _centroids = seedCentroids<T, D, Metric>(init_set, _n_clusters, seeding, rng(), _n_threads, seed_params);
+    _centroids->setThreads(_n_threads);
+}
+
+template<typename T, int D, typename Metric>
+inline const Matrix<T>& OutOfCoreKMeans<T, D, Metric>::getCentroid() const { return *_centroids; }
+
+template<typename T, int D, typename Metric>
+inline int OutOfCoreKMeans<T, D, Metric>::getNIters(){ return _n_iters; }
+
+template<typename T, int D, typename Metric>
+inline double OutOfCoreKMeans<T, D, Metric>::getInertia(){ return _inertia; }
+
+template<typename T, int D, typename Metric>
+inline int OutOfCoreKMeans<T, D, Metric>::chunkSize(int64_t c) const {
+    return static_cast<int>(std::min<int64_t>(_chunk_samples, _samples - c*_chunk_samples));
+}
+
+template<typename T, int D, typename Metric>
+void OutOfCoreKMeans<T, D, Metric>::prefetch(int64_t c){
+    Matrix<T>& chunk = _chunks[_next];
+    _next ^= 1;
+    _prefetch = std::async(std::launch::async, [this, &chunk, c](){
+        _file.read(c * _chunk_samples, chunkSize(c), chunk);
+    });
+}
+
+template<typename T, int D, typename Metric>
+void OutOfCoreKMeans<T, D, Metric>::step(){
+    std::fill(_sums.begin(), _sums.end(), 0);
+    std::fill(_counts.begin(), _counts.end(), 0);
+    _inertia = 0;
+
+    const int64_t n_chunks = (_samples + _chunk_samples - 1) / _chunk_samples;
+    // first chunk already read during the last chunk of the previous pass
+    if(!_prefetch.valid()) prefetch(0);
+    for(int64_t c = 0; c < n_chunks; ++c){
+        _prefetch.get();
+        const Matrix<T>& chunk = _chunks[_next ^ 1];
+        // next chunk (or the first one of the next pass) read and transposed while this one is processed
+        prefetch(c+1 < n_chunks ? c+1 : 0);
+        accumulateChunk(chunk, chunkSize(c));
+    }
+    updateCentroids();
+    ++_n_iters;
+}
+
+template<typename T, int D, typename Metric>
+void OutOfCoreKMeans<T, D, Metric>::run(int max_iter, float threashold){
+    double inertia_prev = -1;
+    for(int iter = 0; iter < max_iter; ++iter){
+        step();
+        if(inertia_prev > 0 && (inertia_prev - _inertia) < threashold * inertia_prev) break;
+        inertia_prev = _inertia;
+    }
+}
+
+template<typename T, int D, typename Metric>
+void OutOfCoreKMeans<T, D, Metric>::accumulateChunk(const Matrix<T>& chunk, int n_chunk){
+    const int n_dims = D == DYNAMIC_DIMS ? _dims : D;
+    ClosestCentroids<T, D, Metric>& labels = n_chunk == _chunk_samples ? *_chunk_to_centroids : *_tail_to_centroids;
+    labels.getClosest(chunk, *_centroids);
+
+    // chunk sums and sizes (deterministic parts, see headers/Update.h)
+    _workspace.reset();
+    const size_t sums_size = static_cast<size_t>(_n_clusters) * n_dims;
+    const update::ClusterSums<T> totals = update::clusterSums(chunk.begin(), _chunk_samples, n_chunk, n_dims, _n_clusters, labels.getLabels(),
+                                                              _update_chunk, _n_threads, _workspace, labels.getDistances());
+    // pass totals in double: many chunks are added up
+    for(size_t n = 0; n < sums_size; ++n) _sums[n] += totals.sums[n];
+    for(int c = 0; c < _n_clusters; ++c) _counts[c] += totals.counts[c];
+    _inertia += totals.inertia;
+}
+
+/**
+ * Mean of each cluster (projected on the unit sphere for NORMALIZED_MEAN),
+ * empty clusters keep their position
+*/
+template<typename T, int D, typename Metric>
+void OutOfCoreKMeans<T, D, Metric>::updateCentroids(){
+    update::meanUpdate(*_centroids, _sums.data(), _counts.data(), Metric::update == NORMALIZED_MEAN);
+}
+
+template<typename T, int D, typename Metric>
+void OutOfCoreKMeans<T, D, Metric>::print(){
+    for(int d = 0; d < _dims; ++d){
+        std::cout << "[";
+        std::cout << _centroids->row(d) << "]," << std::endl;
+    }
+}
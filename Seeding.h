@@ -0,0 +1,394 @@
+#pragma once
+
+#include <vector>
+#include <memory>
+#include <random>
+#include <limits>
+#include <cstdint>
+#include <algorithm>
+#include <type_traits>
+
+#include "headers/Matrix.h"
+#include "headers/Reduction.h"
+#include "Metrics.h"
+
+/**
+ * Initial centroids of KMeans
+ *      UNIFORM_BOX: uniform random points in the bounding box of the dataset
+ *      KMEANS_PP: k-means++ (Arthur & Vassilvitskii), each new centroid is a sample
+ *                 drawn with probability proportional to its Metric::dist to the closest
+ *                 centroid chosen so far (K passes over the dataset)
+ *      KMEANS_PARALLEL: k-means|| (Bahmani et al.), a few oversampling rounds of one pass
+ *                 each then weighted k-means++ over the candidates (see SeedParams)
+ *      AFK_MC2: assumption free k-MC2 (Bachem et al.), k-means++ approximated by Markov
+ *                 chains of chain_length samples drawn from a proposal built in one pass
+*/
+enum SeedEnum { UNIFORM_BOX, KMEANS_PP, KMEANS_PARALLEL, AFK_MC2 };
+
+/**
+ * Settings of the seeding methods
+ *      n_rounds: k-means|| oversampling rounds (5 is enough in practice)
+ *      oversampling: k-means|| expected candidates per round, times K
+ *      chain_length: AFK-MC2 samples per centroid (quality/speed trade-off)
+*/
+struct SeedParams {
+    int n_rounds = 5;
+    double oversampling = 2;
+    int chain_length = 200;
+};
+
+/**
+ * Seeding over the samples of a NxM dataset (optionally weighted).
+ * Keeps the Metric::dist of every sample to its closest centroid so far: adding
+ * a centroid is one parallel pass over the samples (simd::assignBlock when the
+ * metric is vectorized) which also sums the weighted distances per part.
+ * Draws only depend on the seed: the parts and their sums don't depend on the
+ * number of threads (see headers/Reduction.h).
+ * D: number of features if known at compile time (DYNAMIC_DIMS otherwise)
+*/
+template<typename T, int D = DYNAMIC_DIMS, typename Metric = SquaredL2<T>>
+class Seeder{
+public:
+    /**
+     * weights: M non negative samples weights, nullptr for unit weights
+    */
+    Seeder(const Matrix<T>& data, uint64_t seed, int n_threads = 1, const T* weights = nullptr);
+
+    /**
+     * Fills the NxK centroids with K samples chosen by k-means++
+    */
+    void kmeansPP(Matrix<T>& centroids);
+    /**
+     * Fills the NxK centroids by k-means||: every round draws each sample
+     * independently with probability oversampling * K * weight * dist / total
+     * (one pass to update the distances w.r.t. the candidates of the previous round,
+     * then a scan of the distances). The candidates weighted by the number of samples
+     * closest to them are reduced to K centroids by k-means++.
+     * Falls back to kmeansPP when there are fewer than K candidates.
+    */
+    void kmeansParallel(Matrix<T>& centroids, int n_rounds, double oversampling);
+    /**
+     * Fills the NxK centroids by AFK-MC2: after the first centroid, a single pass builds
+     * the proposal q(x) = 1/2 weight * dist(x, c1) / total + 1/2 weight / sum of the weights.
+     * Each next centroid is the end of a Metropolis-Hastings chain of chain_length samples
+     * drawn from q targeting the k-means++ distribution. The chain distances to the
+     * centroids are computed in parallel, the dataset isn't scanned again.
+    */
+    void afkmc2(Matrix<T>& centroids, int chain_length);
+
+private:
+    /**
+     * Lowers the distances (and labels) of the samples closer to one of the
+     * n_centers centers (feature d of center c at centers[c+d*centers_stride],
+     * label first_label+c) than to the previous centroids
+    */
+    void addCenters(const T* centers, int centers_stride, int n_centers, int first_label);
+    /**
+     * Sets every distance to value (value * weight is then the probability mass)
+    */
+    void resetDist(T value);
+    /**
+     * Sample drawn with probability weight * distance, u uniform in [0, 1)
+    */
+    int pick(double u) const;
+    double total() const;
+    void copySample(int i, Matrix<T>& centroids, int k) const;
+    /**
+     * uniform double in [0, 1) from a 64 bits key (splitmix64): independent draws per
+     * sample whatever the thread processing it
+    */
+    static inline double uniformHash(uint64_t key){
+        key += 0x9E3779B97F4A7C15ull;
+        key = (key ^ (key >> 30)) * 0xBF58476D1CE4E5B9ull;
+        key = (key ^ (key >> 27)) * 0x94D049BB133111EBull;
+        key ^= key >> 31;
+        return static_cast<double>(key >> 11) * 0x1.0p-53;
+    }
+
+    inline double weight(int i) const { return _weights ? static_cast<double>(_weights[i]) : 1.; }
+    inline int nDims() const { return D == DYNAMIC_DIMS ? _dims : D; }
+
+    const Matrix<T>& _data;
+    int _dims;
+    int _samples;
+    int _n_threads;
+    const T* _weights;
+    std::mt19937_64 _rng;
+    /**
+     * Metric::dist of each sample to its closest centroid and the index of that centroid
+    */
+    std::vector<T> _min_dist;
+    std::vector<int> _labels;
+    /**
+     * sums of the weighted distances of each part (fixed split of the samples)
+    */
+    int _n_parts;
+    std::vector<double> _part_sums;
+    // samples per block of the parts
+    static constexpr int _chunk = 1024;
+};
+
+template<typename T, int D, typename Metric>
+Seeder<T, D, Metric>::Seeder(const Matrix<T>& data, uint64_t seed, int n_threads, const T* weights) :
+        _data{ data },
+        _dims{ data.getRows() },
+        _samples{ data.getCols() },
+        _n_threads{ n_threads },
+        _weights{ weights },
+        _rng{ seed },
+        _min_dist(data.getCols()),
+        _labels(data.getCols(), 0) {
+
+    assert(D == DYNAMIC_DIMS || D == data.getRows());
+    _n_parts = reduction::partsN(_samples, _chunk);
+    _part_sums.resize(_n_parts);
+}
+
+template<typename T, int D, typename Metric>
+void Seeder<T, D, Metric>::kmeansPP(Matrix<T>& centroids){
+    const int n_clusters = centroids.getCols();
+    assert(centroids.getRows() == _dims && _samples > 0);
+    std::uniform_real_distribution<double> uniform(0, 1);
+
+    // first centroid: probability proportional to the weights
+    resetDist(1);
+    copySample(pick(uniform(_rng)), centroids, 0);
+    resetDist(std::numeric_limits<T>::max());
+    addCenters(centroids.begin(), n_clusters, 1, 0);
+
+    for(int k = 1; k < n_clusters; ++k){
+        copySample(pick(uniform(_rng)), centroids, k);
+        addCenters(centroids.begin()+k, n_clusters, 1, k);
+    }
+}
+
+template<typename T, int D, typename Metric>
+void Seeder<T, D, Metric>::kmeansParallel(Matrix<T>& centroids, int n_rounds, double oversampling){
+    const int n_clusters = centroids.getCols();
+    assert(centroids.getRows() == _dims && _samples > 0);
+    const double expected = oversampling * n_clusters;
+    std::uniform_real_distribution<double> uniform(0, 1);
+    // per sample draws of the rounds
+    const uint64_t stream = _rng();
+
+    resetDist(1);
+    std::vector<int> candidates(1, pick(uniform(_rng)));
+    resetDist(std::numeric_limits<T>::max());
+    // candidates of the last round, NxC (row stride C)
+    std::vector<T> block;
+    std::vector<std::vector<int>> part_picks(_n_parts);
+    int n_added = 0;
+    for(int round = 0; ; ++round){
+        // distances w.r.t. the candidates of the previous round: one pass over the dataset
+        const int n_new = static_cast<int>(candidates.size()) - n_added;
+        block.resize(static_cast<size_t>(n_new) * _dims);
+        for(int d = 0; d < _dims; ++d){
+            for(int c = 0; c < n_new; ++c) block[c+d*n_new] = _data(d, candidates[n_added+c]);
+        }
+        addCenters(block.data(), n_new, n_new, n_added);
+        n_added = static_cast<int>(candidates.size());
+
+        const double psi = total();
+        if(round == n_rounds || !(psi > 0)) break;
+        #pragma omp parallel for num_threads(_n_threads)
+        for(int part = 0; part < _n_parts; ++part){
+            const int from = reduction::partBegin(part, _n_parts, _samples, _chunk);
+            const int to = reduction::partBegin(part+1, _n_parts, _samples, _chunk);
+            part_picks[part].clear();
+            for(int i = from; i < to; ++i){
+                const double u = uniformHash(stream + (static_cast<uint64_t>(round) << 40) + i);
+                if(u * psi < expected * weight(i) * _min_dist[i]) part_picks[part].push_back(i);
+            }
+        }
+        for(int part = 0; part < _n_parts; ++part) candidates.insert(candidates.end(), part_picks[part].begin(), part_picks[part].end());
+    }
+    const int n_candidates = static_cast<int>(candidates.size());
+    if(n_candidates < n_clusters){
+        kmeansPP(centroids);
+        return;
+    }
+
+    // candidates weights: weight of the samples closest to each of them
+    std::vector<T> part_weights(static_cast<size_t>(_n_parts) * n_candidates, 0);
+    #pragma omp parallel for num_threads(_n_threads)
+    for(int part = 0; part < _n_parts; ++part){
+        const int from = reduction::partBegin(part, _n_parts, _samples, _chunk);
+        const int to = reduction::partBegin(part+1, _n_parts, _samples, _chunk);
+        T* weights = part_weights.data() + static_cast<size_t>(part) * n_candidates;
+        for(int i = from; i < to; ++i) weights[_labels[i]] += static_cast<T>(weight(i));
+    }
+    reduction::treeReduce(part_weights.data(), _n_parts, n_candidates, _n_threads);
+
+    Matrix<T> candidates_set(_dims, n_candidates, 0);
+    for(int c = 0; c < n_candidates; ++c) copySample(candidates[c], candidates_set, c);
+    Seeder<T, D, Metric> reclustering(candidates_set, _rng(), _n_threads, part_weights.data());
+    reclustering.kmeansPP(centroids);
+}
+
+template<typename T, int D, typename Metric>
+void Seeder<T, D, Metric>::afkmc2(Matrix<T>& centroids, int chain_length){
+    const int n_clusters = centroids.getCols();
+    const int n_dims = nDims();
+    assert(centroids.getRows() == _dims && _samples > 0 && chain_length > 0);
+    std::uniform_real_distribution<double> uniform(0, 1);
+
+    resetDist(1);
+    const double weights_sum = total();
+    copySample(pick(uniform(_rng)), centroids, 0);
+    resetDist(std::numeric_limits<T>::max());
+    addCenters(centroids.begin(), n_clusters, 1, 0);
+    const double dist_sum = total();
+
+    // proposal cumulative distribution, parts scanned in parallel then offset
+    std::vector<double> cumulative(_samples);
+    std::vector<double> part_offsets(_n_parts+1, 0);
+    #pragma omp parallel for num_threads(_n_threads)
+    for(int part = 0; part < _n_parts; ++part){
+        const int from = reduction::partBegin(part, _n_parts, _samples, _chunk);
+        const int to = reduction::partBegin(part+1, _n_parts, _samples, _chunk);
+        double acc = 0;
+        for(int i = from; i < to; ++i){
+            acc += 0.5 * weight(i) * (dist_sum > 0 ? _min_dist[i] / dist_sum : 0) + 0.5 * weight(i) / weights_sum;
+            cumulative[i] = acc;
+        }
+        part_offsets[part+1] = acc;
+    }
+    for(int part = 0; part < _n_parts; ++part) part_offsets[part+1] += part_offsets[part];
+    #pragma omp parallel for num_threads(_n_threads)
+    for(int part = 1; part < _n_parts; ++part){
+        const int from = reduction::partBegin(part, _n_parts, _samples, _chunk);
+        const int to = reduction::partBegin(part+1, _n_parts, _samples, _chunk);
+        for(int i = from; i < to; ++i) cumulative[i] += part_offsets[part];
+    }
+    const double q_sum = cumulative[_samples-1];
+    auto proposal = [&](int i){ return cumulative[i] - (i ? cumulative[i-1] : 0); };
+
+    std::vector<int> chain(chain_length);
+    std::vector<double> chain_dist(chain_length);
+    for(int k = 1; k < n_clusters; ++k){
+        for(int j = 0; j < chain_length; ++j){
+            const double target = uniform(_rng) * q_sum;
+            chain[j] = std::min(_samples-1, static_cast<int>(std::upper_bound(cumulative.begin(), cumulative.end(), target) - cumulative.begin()));
+        }
+        // distances of the chain samples to the k centroids chosen so far
+        #pragma omp parallel for num_threads(_n_threads)
+        for(int j = 0; j < chain_length; ++j){
+            T min_dist = std::numeric_limits<T>::max();
+            for(int c = 0; c < k; ++c){
+                min_dist = std::min(min_dist, Metric::template dist<D>(_data.begin()+chain[j], _samples, centroids.begin()+c, n_clusters, n_dims));
+            }
+            // importance of the sample w.r.t. the k-means++ distribution
+            const double q = proposal(chain[j]);
+            chain_dist[j] = q > 0 ? weight(chain[j]) * min_dist / q : 0;
+        }
+        int x = 0;
+        for(int j = 1; j < chain_length; ++j){
+            if(chain_dist[j] > uniform(_rng) * chain_dist[x]) x = j;
+        }
+        copySample(chain[x], centroids, k);
+    }
+}
+
+template<typename T, int D, typename Metric>
+void Seeder<T, D, Metric>::addCenters(const T* centers, int centers_stride, int n_centers, int first_label){
+    const int n_dims = nDims();
+    const T* data = _data.begin();
+
+    #pragma omp parallel for num_threads(_n_threads)
+    for(int part = 0; part < _n_parts; ++part){
+        const int from = reduction::partBegin(part, _n_parts, _samples, _chunk);
+        const int to = reduction::partBegin(part+1, _n_parts, _samples, _chunk);
+        if constexpr(Metric::vectorized && (std::is_same<T, float>::value || std::is_same<T, double>::value)){
+            simd::assignBlock<Metric::kernel, D>(data+from, _samples, to-from, centers, centers_stride, n_dims, n_centers, first_label,
+                                                 _labels.data()+from, _min_dist.data()+from);
+        } else {
+            for(int i = from; i < to; ++i){
+                for(int c = 0; c < n_centers; ++c){
+                    const T dist = Metric::template dist<D>(data+i, _samples, centers+c, centers_stride, n_dims);
+                    if(dist < _min_dist[i]){
+                        _min_dist[i] = dist;
+                        _labels[i] = first_label+c;
+                    }
+                }
+            }
+        }
+        double sum = 0;
+        for(int i = from; i < to; ++i) sum += weight(i) * _min_dist[i];
+        _part_sums[part] = sum;
+    }
+}
+
+template<typename T, int D, typename Metric>
+void Seeder<T, D, Metric>::resetDist(T value){
+    std::fill(_min_dist.begin(), _min_dist.end(), value);
+    std::fill(_labels.begin(), _labels.end(), 0);
+    for(int part = 0; part < _n_parts; ++part){
+        const int from = reduction::partBegin(part, _n_parts, _samples, _chunk);
+        const int to = reduction::partBegin(part+1, _n_parts, _samples, _chunk);
+        double sum = 0;
+        for(int i = from; i < to; ++i) sum += weight(i) * value;
+        _part_sums[part] = sum;
+    }
+}
+
+template<typename T, int D, typename Metric>
+int Seeder<T, D, Metric>::pick(double u) const {
+    const double mass = total();
+    // every sample is a centroid already (duplicates): uniform draw
+    if(!(mass > 0)) return std::min(_samples-1, static_cast<int>(u * _samples));
+
+    double target = u * mass;
+    // last part with a positive mass (target may exceed the sum of the parts by rounding)
+    int last = _n_parts-1;
+    while(!(_part_sums[last] > 0)) --last;
+    int part = 0;
+    while(part < last && target >= _part_sums[part]){
+        target -= _part_sums[part];
+        ++part;
+    }
+    const int from = reduction::partBegin(part, _n_parts, _samples, _chunk);
+    const int to = reduction::partBegin(part+1, _n_parts, _samples, _chunk);
+    int chosen = -1;
+    double acc = 0;
+    for(int i = from; i < to; ++i){
+        const double mass = weight(i) * _min_dist[i];
+        if(mass > 0){
+            chosen = i;
+            acc += mass;
+            if(acc > target) break;
+        }
+    }
+    return chosen;
+}
+
+template<typename T, int D, typename Metric>
+inline double Seeder<T, D, Metric>::total() const {
+    double sum = 0;
+    for(int part = 0; part < _n_parts; ++part) sum += _part_sums[part];
+    return sum;
+}
+
+template<typename T, int D, typename Metric>
+inline void Seeder<T, D, Metric>::copySample(int i, Matrix<T>& centroids, int k) const {
+    for(int d = 0; d < _dims; ++d) centroids(d, k) = _data(d, i);
+}
+
+/**
+ * NxK centroids seeded over the NxM data by the given method (UNIFORM_BOX ignores
+ * the seed and the weights), the seeding step of the KMeans variants
+*/
+template<typename T, int D = DYNAMIC_DIMS, typename Metric = SquaredL2<T>>
+std::unique_ptr<Matrix<T>> seedCentroids(const Matrix<T>& data, int n_clusters, SeedEnum seeding, uint64_t seed, int n_threads = 1,
+                                         SeedParams params = SeedParams(), const T* weights = nullptr){
+    if(seeding == UNIFORM_BOX){
+        Matrix<T> vMinValues = data.vMin();
+        Matrix<T> vMaxValues = data.vMax();
+        return std::make_unique<Matrix<T>>(data.getRows(), n_clusters, UNIFORM, vMinValues, vMaxValues);
+    }
+    auto centroids = std::make_unique<Matrix<T>>(data.getRows(), n_clusters, 0);
+    Seeder<T, D, Metric> seeder(data, seed, n_threads, weights);
+    if(seeding == KMEANS_PARALLEL) seeder.kmeansParallel(*centroids, params.n_rounds, params.oversampling);
+    else if(seeding == AFK_MC2) seeder.afkmc2(*centroids, params.chain_length);
+    else seeder.kmeansPP(*centroids);
+    return centroids;
+}
@@ -0,0 +1,228 @@
+#pragma once
+
+#include <vector>
+#include <memory>
+#include <cstdint>
+#include <algorithm>
+
+#include "headers/Matrix.h"
+#include "headers/Update.h"
+#include "headers/Workspace.h"
+#include "ClosestCentroids.h"
+#include "Seeding.h"
+
+/**
+ * Online k-means over an unbounded stream of samples pushed by chunks (NxB
+ * feature-major matrices, B may change from one chunk to the next).
+ * The samples of a chunk are mapped with the ClosestCentroids kernels to the
+ * current centroids, then every centroid becomes the weighted mean
+ *      c = (decay * w * c + chunk sum) / (decay * w + chunk count), w = decay * w + chunk count
+ * decay = 1 (default) gives the mean of every sample the centroid has been given,
+ * decay < 1 forgets the past (weight halved every log(0.5)/log(decay) chunks).
+ * With a window of n chunks, a centroid is instead the mean of its samples of
+ * the last n chunks (kept as n per chunk sums).
+ * Only the centroids, their weights and the window sums are kept: O(n K N) memory
+ * whatever the number of samples seen (plus the buffers of the largest chunk).
+ * The centroids are seeded by k-means++ on the first 3 K samples.
+ * D: number of features if known at compile time (DYNAMIC_DIMS otherwise)
+ * Metric: mean (SquaredL2) or normalized mean (Cosine) update
+*/
+template<typename T, int D = DYNAMIC_DIMS, typename Metric = SquaredL2<T>>
+class StreamingKMeans{
+public:
+    StreamingKMeans(int n_dims, int n_clusters, int n_threads=1, uint64_t seed=0);
+
+    /**
+     * Weight of the past per chunk, in (0, 1]. Disables the window.
+    */
+    void setDecay(double decay);
+    /**
+     * Centroids computed from the last n_chunks chunks only (0 to disable)
+    */
+    void setWindow(int n_chunks);
+
+    /**
+     * Maps the samples of the chunk and updates the centroids
+    */
+    void push(const Matrix<T>& chunk);
+
+    const Matrix<T>& getCentroid() const;
+    /**
+     * mapping of the samples of the last chunk
+    */
+    const Matrix<int>& getDataToCentroid() const;
+    /**
+     * weight of each cluster (decayed or windowed number of samples)
+    */
+    const std::vector<double>& getWeights() const { return _weights; }
+    int64_t getNSamples() const { return _n_samples; }
+    bool isSeeded() const { return _seeded; }
+
+    void print();
+
+private:
+    void seed();
+    void update(const Matrix<T>& chunk);
+
+    int _dims;
+    int _n_clusters;
+    int _n_threads;
+    uint64_t _seed;
+    bool _seeded = false;
+    int64_t _n_samples = 0;
+    /**
+     * NxK centroids and their weights
+    */
+    std::unique_ptr<Matrix<T>> _centroids;
+    std::vector<double> _weights;
+    double _decay = 1;
+    /**
+     * window: clusters sums (sums[c+d*K]) and sizes of the last _window chunks,
+     * slot _window_pos is the oldest one
+    */
+    int _window = 0;
+    int _window_pos = 0;
+    std::vector<T> _window_sums;
+    std::vector<int> _window_counts;
+    /**
+     * samples waiting for the seeding (sample-major), at most 3 K
+    */
+    std::vector<T> _pending;
+    /**
+     * mapping of the last chunk (reallocated when the chunk size changes)
+    */
+    std::unique_ptr<ClosestCentroids<T, D, Metric>> _chunk_to_centroids;
+    Workspace _workspace;
+    // chunk samples per part of the update sums
+    static constexpr int _update_chunk = 1024;
+};
+
+template<typename T, int D, typename Metric>
+StreamingKMeans<T, D, Metric>::StreamingKMeans(int n_dims, int n_clusters, int n_threads, uint64_t seed) :
+        _dims{ n_dims },
+        _n_clusters{ n_clusters },
+        _n_threads{ n_threads },
+        _seed{ seed },
+        _centroids{ std::make_unique<Matrix<T>>(n_dims, n_clusters, 0, n_threads) },
+        _weights(n_clusters, 0) {
+
+    static_assert(Metric::update != MEDIAN, "StreamingKMeans: mean or normalized mean update only");
+    assert(D == DYNAMIC_DIMS || D == n_dims);
+    _pending.reserve(static_cast<size_t>(3) * n_clusters * n_dims);
+}
+
+template<typename T, int D, typename Metric>
+void StreamingKMeans<T, D, Metric>::setDecay(double decay){
+    assert(decay > 0 && decay <= 1);
+    _decay = decay;
+    _window = 0;
+}
+
+template<typename T, int D, typename Metric>
+void StreamingKMeans<T, D, Metric>::setWindow(int n_chunks){
+    _window = n_chunks;
+    _window_pos = 0;
+    _window_sums.assign(static_cast<size_t>(n_chunks) * _n_clusters * _dims, 0);
+    _window_counts.assign(static_cast<size_t>(n_chunks) * _n_clusters, 0);
+}
+
+template<typename T, int D, typename Metric>
+void StreamingKMeans<T, D, Metric>::push(const Matrix<T>& chunk){
+    assert(chunk.getRows() == _dims);
+    const int n_chunk = chunk.getCols();
+    _n_samples += n_chunk;
+    if(_seeded){
+        update(chunk);
+        return;
+    }
+    // buffers the first samples until there is enough of them to seed
+    const int capacity = 3 * _n_clusters;
+    int taken = 0;
+    for(; taken < n_chunk && static_cast<int>(_pending.size()) < capacity * _dims; ++taken){
+        for(int d = 0; d < _dims; ++d) _pending.push_back(chunk(d, taken));
+    }
+    if(static_cast<int>(_pending.size()) < capacity * _dims) return;
+    seed();
+    if(taken < n_chunk){
+        Matrix<T> rest(_dims, n_chunk - taken, 0, _n_threads);
+        for(int d = 0; d < _dims; ++d){
+            std::copy(chunk.rowBegin(d) + taken, chunk.rowEnd(d), rest.rowBegin(d));
+        }
+        update(rest);
+    }
+}
+
+/**
+ * k-means++ over the pending samples, which then make the first chunk
+*/
+template<typename T, int D, typename Metric>
+void StreamingKMeans<T, D, Metric>::seed(){
+    const int n_pending = static_cast<int>(_pending.size()) / _dims;
+    Matrix<T> pending(_dims, n_pending, 0, _n_threads);
+    for(int i = 0; i < n_pending; ++i){
+        for(int d = 0; d < _dims; ++d) pending(d, i) = _pending[i*_dims+d];
+    }
+    Seeder<T, D, Metric> seeder(pending, _seed, _n_threads);
+    seeder.kmeansPP(*_centroids);
+    _seeded = true;
+    std::vector<T>().swap(_pending);
+    update(pending);
+}
+
+template<typename T, int D, typename Metric>
+void StreamingKMeans<T, D, Metric>::update(const Matrix<T>& chunk){
+    const int n_dims = D == DYNAMIC_DIMS ? _dims : D;
+    const int n_chunk = chunk.getCols();
+    if(!_chunk_to_centroids || _chunk_to_centroids->getCols() != n_chunk){
+        _chunk_to_centroids = std::make_unique<ClosestCentroids<T, D, Metric>>(n_chunk, 0, false, _n_threads);
+    }
+    _chunk_to_centroids->getClosest(chunk, *_centroids);
+
+    // chunk sums and sizes (deterministic parts, see headers/Update.h)
+    _workspace.reset();
+    const size_t sums_size = static_cast<size_t>(_n_clusters) * n_dims;
+    const update::ClusterSums<T> totals = update::clusterSums(chunk.begin(), n_chunk, n_chunk, n_dims, _n_clusters,
+                                                              _chunk_to_centroids->getLabels(), _update_chunk, _n_threads, _workspace);
+    constexpr bool normalize = Metric::update == NORMALIZED_MEAN;
+
+    if(_window){
+        // the chunk replaces the oldest one of the window
+        std::copy(totals.sums, totals.sums+sums_size, _window_sums.begin() + _window_pos*sums_size);
+        std::copy(totals.counts, totals.counts+_n_clusters, _window_counts.begin() + static_cast<size_t>(_window_pos)*_n_clusters);
+        _window_pos = (_window_pos + 1) % _window;
+        double* sums = _workspace.allocZero<double>(sums_size);
+        for(int w = 0; w < _window; ++w){
+            for(size_t j = 0; j < sums_size; ++j) sums[j] += _window_sums[w*sums_size+j];
+        }
+        std::fill(_weights.begin(), _weights.end(), 0);
+        for(int w = 0; w < _window; ++w){
+            for(int c = 0; c < _n_clusters; ++c) _weights[c] += _window_counts[static_cast<size_t>(w)*_n_clusters+c];
+        }
+        // no sample in the window: the centroid stays where it is
+        update::meanUpdate(*_centroids, sums, _weights.data(), normalize);
+        return;
+    }
+    double* past = _workspace.alloc<double>(_n_clusters);
+    for(int c = 0; c < _n_clusters; ++c){
+        past[c] = _decay * _weights[c];
+        _weights[c] = past[c] + totals.counts[c];
+    }
+    update::meanUpdate(*_centroids, totals.sums, totals.counts, normalize, past);
+}
+
+template<typename T, int D, typename Metric>
+inline const Matrix<T>& StreamingKMeans<T, D, Metric>::getCentroid() const { return *_centroids; }
+
+template<typename T, int D, typename Metric>
+inline const Matrix<int>& StreamingKMeans<T, D, Metric>::getDataToCentroid() const {
+    assert(_chunk_to_centroids);
+    return *static_cast<Matrix<int>* >(_chunk_to_centroids.get());
+}
+
+template<typename T, int D, typename Metric>
+void StreamingKMeans<T, D, Metric>::print(){
+    for(int d = 0; d < _dims; ++d){
+        std::cout << "[";
+        std::cout << _centroids->row(d) << "]," << std::endl;
+    }
+}
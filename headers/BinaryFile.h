@@ -0,0 +1,114 @@
+#pragma once
+
+#include <fstream>
+#include <string>
+#include <vector>
+#include <cstdio>
+#include <cstdint>
+#include <cstdlib>
+#include <algorithm>
+
+#include "Matrix.h"
+
+/**
+ * Binary dataset file: a header (signature, sizeof(T), number of samples and number
+ * of features, uint64_t each) followed by the samples one after the other (sample-major
+ * T values, the layout of a csv file with one sample per line).
+ * Samples are read back by chunks into NxB feature-major matrices (KMeans layout)
+ * so a dataset larger than the memory can be processed chunk by chunk.
+ * I/O errors, a file of another format or value type and reads out of the file
+ * abort with a message (not only in debug builds).
+*/
+template<typename T>
+class BinaryFile{
+public:
+    explicit BinaryFile(const std::string& path);
+
+    /**
+     * Writes the NxM feature-major dataset (samples transposed by chunks)
+    */
+    static void write(const std::string& path, const Matrix<T>& dataset, int chunk_samples = 1 << 16);
+
+    int64_t getSamples() const { return _samples; }
+    int getFeatures() const { return _features; }
+
+    /**
+     * Reads the samples [from, from+n) into the first n columns of the chunk
+     * (reallocated to Nxn if it has other rows or fewer columns, a larger chunk
+     * keeps its shape). Not thread safe: one read at a time per BinaryFile.
+    */
+    void read(int64_t from, int n, Matrix<T>& chunk);
+
+private:
+    static void check(bool ok, const char* what, const std::string& path){
+        if(ok) return;
+        std::fprintf(stderr, "BinaryFile: %s (%s)\n", what, path.c_str());
+        std::abort();
+    }
+
+    // "KMEANSDS" in the first 8 bytes of the file
+    static constexpr uint64_t _signature = 0x5344534e41454d4bULL;
+    static constexpr int64_t _header_size = 4 * sizeof(uint64_t);
+
+    std::string _path;
+    std::ifstream _file;
+    int64_t _samples = 0;
+    int _features = 0;
+    // sample-major values of the last read
+    std::vector<T> _buffer;
+};
+
+template<typename T>
+BinaryFile<T>::BinaryFile(const std::string& path) :
+        _path{ path },
+        _file(path, std::ios::binary) {
+
+    check(_file.is_open(), "cannot open", path);
+    uint64_t header[4];
+    _file.read(reinterpret_cast<char*>(header), sizeof(header));
+    check(_file.good(), "truncated header", path);
+    check(header[0] == _signature, "not a dataset file", path);
+    check(header[1] == sizeof(T), "values of another type", path);
+    _samples = static_cast<int64_t>(header[2]);
+    _features = static_cast<int>(header[3]);
+    _file.seekg(0, std::ios::end);
+    check(static_cast<int64_t>(_file.tellg()) == _header_size + _samples * _features * static_cast<int64_t>(sizeof(T)),
+          "size doesn't match the header", path);
+}
+
+template<typename T>
+void BinaryFile<T>::write(const std::string& path, const Matrix<T>& dataset, int chunk_samples){
+    std::ofstream file(path, std::ios::binary | std::ios::trunc);
+    check(file.is_open(), "cannot create", path);
+    const int rows = dataset.getRows();
+    const int cols = dataset.getCols();
+    const uint64_t header[4] = { _signature, sizeof(T), static_cast<uint64_t>(cols), static_cast<uint64_t>(rows) };
+    file.write(reinterpret_cast<const char*>(header), sizeof(header));
+
+    std::vector<T> buffer(static_cast<size_t>(chunk_samples) * rows);
+    for(int from = 0; from < cols; from += chunk_samples){
+        const int n = std::min(chunk_samples, cols - from);
+        for(int d = 0; d < rows; ++d){
+            for(int i = 0; i < n; ++i) buffer[static_cast<size_t>(i)*rows+d] = dataset(d, from+i);
+        }
+        file.write(reinterpret_cast<const char*>(buffer.data()), static_cast<std::streamsize>(sizeof(T)) * n * rows);
+        check(file.good(), "write failed", path);
+    }
+    file.flush();
+    check(file.good(), "write failed", path);
+}
+
+template<typename T>
+void BinaryFile<T>::read(int64_t from, int n, Matrix<T>& chunk){
+    check(from >= 0 && n >= 0 && from + n <= _samples, "read out of the file", _path);
+    if(chunk.getRows() != _features || chunk.getCols() < n) chunk = Matrix<T>(_features, n, 0);
+    _buffer.resize(static_cast<size_t>(n) * _features);
+    _file.clear();
+    _file.seekg(_header_size + from * _features * static_cast<int64_t>(sizeof(T)));
+    _file.read(reinterpret_cast<char*>(_buffer.data()), static_cast<std::streamsize>(sizeof(T)) * n * _features);
+    check(_file.good(), "read failed", _path);
+    for(int d = 0; d < _features; ++d){
+        T* row = chunk.rowBegin(d);
+        for(int i = 0; i < n; ++i) row[i] = _buffer[static_cast<size_t>(i)*_features+d];
+    }
+}
@@ -0,0 +1,161 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring> // std::memcpy
+
+#include "SIMDKernels.h"
+
+#ifdef SIMD_KERNELS_ENABLED
+#include <immintrin.h>
+#endif
+
+/**
+ * Storage precision of the training set
+ *      FULL: T (float or double)
+ *      FP16: IEEE 754 half precision (10 bits mantissa, +-65504)
+ *      BF16: bfloat16 (7 bits mantissa, float range)
+ * Half precision values are stored as raw uint16_t bits and converted
+ * back to float right before use: distances and sums are computed in T.
+*/
+enum PrecisionEnum { FULL, FP16, BF16 };
+
+namespace half {
+
+/**
+ * Round to nearest even (scalar, portable)
+*/
+inline uint16_t fp16FromFloat(float value){
+    uint32_t x;
+    std::memcpy(&x, &value, sizeof(x));
+    const uint32_t sign = (x >> 16) & 0x8000;
+    const int32_t exponent = static_cast<int32_t>((x >> 23) & 0xFF) - 127 + 15;
+    uint32_t mantissa = x & 0x7FFFFF;
+    // inf / nan
+    if(((x >> 23) & 0xFF) == 0xFF) return static_cast<uint16_t>(sign | 0x7C00 | (mantissa ? 0x200 : 0));
+    // overflow -> inf
+    if(exponent >= 31) return static_cast<uint16_t>(sign | 0x7C00);
+    // subnormal or zero
+    if(exponent <= 0){
+        if(exponent < -10) return static_cast<uint16_t>(sign);
+        mantissa |= 0x800000;
+        const int shift = 14 - exponent;
+        uint32_t half_mantissa = mantissa >> shift;
+        const uint32_t rest = mantissa & ((1u << shift) - 1);
+        const uint32_t halfway = 1u << (shift - 1);
+        if(rest > halfway || (rest == halfway && (half_mantissa & 1))) ++half_mantissa;
+        return static_cast<uint16_t>(sign | half_mantissa);
+    }
+    uint32_t half = sign | (static_cast<uint32_t>(exponent) << 10) | (mantissa >> 13);
+    const uint32_t rest = mantissa & 0x1FFF;
+    // a carry into the exponent gives the right result (up to inf)
+    if(rest > 0x1000 || (rest == 0x1000 && (half & 1))) ++half;
+    return static_cast<uint16_t>(half);
+}
+
+inline float fp16ToFloat(uint16_t value){
+    const uint32_t sign = static_cast<uint32_t>(value & 0x8000) << 16;
+    uint32_t exponent = (value >> 10) & 0x1F;
+    uint32_t mantissa = value & 0x3FF;
+    uint32_t x;
+    if(exponent == 0x1F) x = sign | 0x7F800000 | (mantissa << 13);
+    else if(exponent){
+        x = sign | ((exponent + 127 - 15) << 23) | (mantissa << 13);
+    } else if(!mantissa) x = sign;
+    else {
+        // subnormal: normalize the mantissa
+        exponent = 127 - 15 + 1;
+        while(!(mantissa & 0x400)){
+            mantissa <<= 1;
+            --exponent;
+        }
+        x = sign | (exponent << 23) | ((mantissa & 0x3FF) << 13);
+    }
+    float result;
+    std::memcpy(&result, &x, sizeof(result));
+    return result;
+}
+
+/**
+ * Round to nearest even (nan kept quiet)
+*/
+inline uint16_t bf16FromFloat(float value){
+    uint32_t x;
+    std::memcpy(&x, &value, sizeof(x));
+    if((x & 0x7FFFFFFF) > 0x7F800000) return static_cast<uint16_t>((x >> 16) | 0x40);
+    x += 0x7FFF + ((x >> 16) & 1);
+    return static_cast<uint16_t>(x >> 16);
+}
+
+inline float bf16ToFloat(uint16_t value){
+    const uint32_t x = static_cast<uint32_t>(value) << 16;
+    float result;
+    std::memcpy(&result, &x, sizeof(result));
+    return result;
+}
+
+inline uint16_t fromFloat(float value, PrecisionEnum precision){
+    return precision == BF16 ? bf16FromFloat(value) : fp16FromFloat(value);
+}
+
+inline float toFloat(uint16_t value, PrecisionEnum precision){
+    return precision == BF16 ? bf16ToFloat(value) : fp16ToFloat(value);
+}
+
+#ifdef SIMD_KERNELS_ENABLED
+__attribute__((target("f16c"))) inline void fp16ToFloatF16C(const uint16_t* src, float* dst, int n){
+    int i = 0;
+    for(; i+8 <= n; i += 8){
+        _mm256_storeu_ps(dst+i, _mm256_cvtph_ps(_mm_loadu_si128(reinterpret_cast<const __m128i*>(src+i))));
+    }
+    for(; i < n; ++i) dst[i] = fp16ToFloat(src[i]);
+}
+
+__attribute__((target("f16c"))) inline void fp16FromFloatF16C(const float* src, uint16_t* dst, int n){
+    int i = 0;
+    for(; i+8 <= n; i += 8){
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst+i), _mm256_cvtps_ph(_mm256_loadu_ps(src+i), _MM_FROUND_TO_NEAREST_INT));
+    }
+    for(; i < n; ++i) dst[i] = fp16FromFloat(src[i]);
+}
+
+inline bool hasF16C(){
+    static const bool f16c = [](){
+        __builtin_cpu_init();
+        return static_cast<bool>(__builtin_cpu_supports("f16c"));
+    }();
+    return f16c;
+}
+#endif
+
+/**
+ * Converts n half precision values to float. FP16 uses the F16C instructions
+ * when the CPU has them (runtime check), BF16 is a 16 bits shift the compiler vectorizes.
+*/
+inline void toFloat(const uint16_t* src, float* dst, int n, PrecisionEnum precision){
+    if(precision == BF16){
+        for(int i = 0; i < n; ++i){
+            const uint32_t x = static_cast<uint32_t>(src[i]) << 16;
+            std::memcpy(dst+i, &x, sizeof(float));
+        }
+        return;
+    }
+#ifdef SIMD_KERNELS_ENABLED
+    if(hasF16C()){
+        fp16ToFloatF16C(src, dst, n);
+        return;
+    }
+#endif
+    for(int i = 0; i < n; ++i) dst[i] = fp16ToFloat(src[i]);
+}
+
+inline void fromFloat(const float* src, uint16_t* dst, int n, PrecisionEnum precision){
+#ifdef SIMD_KERNELS_ENABLED
+    if(precision == FP16 && hasF16C()){
+        fp16FromFloatF16C(src, dst, n);
+        return;
+    }
+#endif
+    for(int i = 0; i < n; ++i) dst[i] = fromFloat(src[i], precision);
+}
+
+} // namespace half
@@ -82,8 +82,8 @@ public:
 	std::pair<int, int> maxIndex();
 	Matrix<T> hMin();
 	Matrix<T> hMax();
-	Matrix<T> vMin();
-	Matrix<T> vMax();
+	Matrix<T> vMin() const;
+	Matrix<T> vMax() const;
 	T min();
 	T max();
 	
@@ -1126,7 +1126,7 @@ Matrix<T> Matrix<T>::hMax(){
  *  [8, 9, 0, 1]]		[0]]
  */
 template<typename T>
-Matrix<T> Matrix<T>::vMin(){
+Matrix<T> Matrix<T>::vMin() const {
 	T curr_min = std::numeric_limits<T>::max();
 	Matrix<T> res(_rows, 1, curr_min, _n_threads);
 	
@@ -1149,7 +1149,7 @@ Matrix<T> Matrix<T>::vMin(){
  *  [8, 9, 0, 1]]		[9]]
  */
 template<typename T>
-Matrix<T> Matrix<T>::vMax(){
+Matrix<T> Matrix<T>::vMax() const {
 	T curr_max = std::numeric_limits<T>::min();
 	Matrix<T> res(_rows, 1, curr_max, _n_threads);
 	
@@ -0,0 +1,50 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+
+/**
+ * Deterministic parallel reductions: a pass over the samples is split in parts
+ * that only depend on the number of samples (never on the number of threads),
+ * each part fills its own accumulator and the accumulators are summed with a
+ * fixed pairwise tree. The result is then bit-identical for any n_threads.
+*/
+namespace reduction {
+
+// maximum number of partial accumulators of a pass
+constexpr int max_parts = 64;
+
+/**
+ * Number of parts for n_items items: blocks of align items, at least
+ * min_items items per part and at most max_parts parts
+*/
+inline int partsN(int n_items, int align, int min_items = 0){
+    const int n_blocks = (n_items + align - 1) / align;
+    const int by_size = std::max(1, n_items / std::max(1, min_items));
+    return std::max(1, std::min(std::min(n_blocks, by_size), max_parts));
+}
+
+/**
+ * First item of a part (multiple of align), partBegin(n_parts, ...) == n_items
+*/
+inline int partBegin(int part, int n_parts, int n_items, int align){
+    const long long n_blocks = (n_items + align - 1) / align;
+    return static_cast<int>(std::min<long long>(n_items, part * n_blocks / n_parts * align));
+}
+
+/**
+ * Sums the n_parts arrays parts[p*size, (p+1)*size) into the first one:
+ * ((p0 + p1) + (p2 + p3)) + ... The order of the additions is fixed, each
+ * element being reduced by one thread.
+*/
+template<typename T>
+void treeReduce(T* parts, int n_parts, size_t size, int n_threads){
+    for(int step = 1; step < n_parts; step *= 2){
+        #pragma omp parallel for num_threads(n_threads)
+        for(long long j = 0; j < static_cast<long long>(size); ++j){
+            for(int p = 0; p + step < n_parts; p += 2*step) parts[p*size+j] += parts[(p+step)*size+j];
+        }
+    }
+}
+
+} // namespace reduction
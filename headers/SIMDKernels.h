@@ -0,0 +1,828 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring> // std::memcpy
+#include <limits>
+#include <type_traits>
+#ifdef __linux__
+#include <unistd.h> // sysconf
+#endif
+
+/**
+ * Explicitly vectorized sample -> closest centroid kernels.
+ *
+ * Data is stored feature-major (NxM, one row per feature) so the kernels
+ * vectorize across samples: a vector holds the same feature of W consecutive
+ * samples and each centroid coordinate is broadcasted.
+ *
+ * Kernels are compiled for SSE4.2, AVX2 and AVX-512F regardless of the
+ * compilation flags (function level target attributes) and the best one
+ * supported by the running CPU is selected once at first call (CPUID).
+ * Results are the same as the scalar loops: same summation order, no FMA,
+ * lowest index kept on ties.
+ * gemmArgmin (GEMM engine) is the exception: register blocked and FMA based,
+ * its rounding differs from the scalar loop.
+*/
+namespace simd {
+
+enum ISAEnum { SCALAR, SSE42, AVX2, AVX512 };
+enum KernelEnum { L1_KERNEL, SQ_L2_KERNEL };
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define SIMD_KERNELS_ENABLED
+#endif
+
+/**
+ * Best instruction set supported by the CPU (checked once)
+*/
+inline ISAEnum detectISA(){
+#ifdef SIMD_KERNELS_ENABLED
+    static const ISAEnum isa = [](){
+        __builtin_cpu_init();
+        if(__builtin_cpu_supports("avx512f")) return AVX512;
+        if(__builtin_cpu_supports("avx2")) return AVX2;
+        if(__builtin_cpu_supports("sse4.2")) return SSE42;
+        return SCALAR;
+    }();
+    return isa;
+#else
+    return SCALAR;
+#endif
+}
+
+/**
+ * Whether the CPU has FMA3 (checked once), used by the AVX2 gemmArgmin kernel
+*/
+inline bool hasFMA(){
+#ifdef SIMD_KERNELS_ENABLED
+    static const bool fma = [](){
+        __builtin_cpu_init();
+        return __builtin_cpu_supports("fma") != 0;
+    }();
+    return fma;
+#else
+    return false;
+#endif
+}
+
+/**
+ * Data cache size in bytes of the given level (1 or 2) of the running CPU (checked once).
+ * Falls back to 32KB (L1) and 256KB (L2) when the OS doesn't report it.
+*/
+inline long cacheSize(int level){
+    static const long l1 = [](){
+        long size = 0;
+#if defined(__linux__) && defined(_SC_LEVEL1_DCACHE_SIZE)
+        size = sysconf(_SC_LEVEL1_DCACHE_SIZE);
+#endif
+        return size > 0 ? size : 32L << 10;
+    }();
+    static const long l2 = [](){
+        long size = 0;
+#if defined(__linux__) && defined(_SC_LEVEL2_CACHE_SIZE)
+        size = sysconf(_SC_LEVEL2_CACHE_SIZE);
+#endif
+        return size > 0 ? size : 256L << 10;
+    }();
+    return level <= 1 ? l1 : l2;
+}
+
+/**
+ * Scalar reference. Also handles the remaining samples of the vectorized kernels.
+ *
+ * Dims: number of features if known at compile time (0 otherwise, n_dims is used)
+ * Update: labels/min_dist already hold a mapping (previous clusters blocks) which is
+ *         only replaced by strictly closer centroids
+ * data: pointer to the first sample of the block in feature 0, feature d at data+d*stride
+ * cluster: NxK centroids with row stride cluster_stride
+ * cluster_offset: index of the first centroid of cluster (labels are offset by it)
+ * labels/min_dist: outputs of the block (n_samples elements)
+*/
+template<KernelEnum Kernel, int Dims, bool Update, typename T>
+inline void assignScalar(const T* data, int stride, int n_samples,
+        const T* cluster, int cluster_stride, int n_dims, int n_clusters, int cluster_offset,
+        int* labels, T* min_dist){
+    if(Dims) n_dims = Dims;
+    for(int i = 0; i < n_samples; ++i){
+        T best = Update ? min_dist[i] : std::numeric_limits<T>::max();
+        int k_index = Update ? labels[i] : 0;
+        for(int c = 0; c < n_clusters; ++c){
+            T acc = 0;
+            for(int d = 0; d < n_dims; ++d){
+                T diff = data[i+d*stride] - cluster[c+d*cluster_stride];
+                if(Kernel == L1_KERNEL) acc += (diff < 0 ? -diff : diff);
+                else acc += diff * diff;
+            }
+            if(acc < best){
+                best = acc;
+                k_index = c + cluster_offset;
+            }
+        }
+        labels[i] = k_index;
+        min_dist[i] = best;
+    }
+}
+
+/**
+ * Scalar reference of distances: dist[i] between sample i and a single point
+ * (feature d at point[d*point_stride]), same arithmetic as assignScalar
+*/
+template<KernelEnum Kernel, int Dims, typename T>
+inline void distancesScalar(const T* data, int stride, int n_samples, const T* point, int point_stride, int n_dims, T* dist){
+    if(Dims) n_dims = Dims;
+    for(int i = 0; i < n_samples; ++i){
+        T acc = 0;
+        for(int d = 0; d < n_dims; ++d){
+            T diff = data[i+d*stride] - point[d*point_stride];
+            if(Kernel == L1_KERNEL) acc += (diff < 0 ? -diff : diff);
+            else acc += diff * diff;
+        }
+        dist[i] = acc;
+    }
+}
+
+/**
+ * Running ranking of the GEMM engine, one entry per sample: the three smallest
+ * values of offset[c] + scale[c] * x.c so far and the centroids of the two first
+*/
+template<typename T>
+struct GemmRanking {
+    T* best;
+    T* second;
+    T* third;
+    int* k_best;
+    int* k_second;
+};
+
+/**
+ * Scalar reference of gemmArgmin, also handles the remaining samples of the vectorized kernels
+*/
+template<typename T>
+inline void gemmArgminScalar(const T* data, int stride, int n_samples, const T* cluster, int cluster_stride,
+        int n_dims, int n_clusters, int cluster_offset, const T* offset, const T* scale, GemmRanking<T> ranking){
+    for(int i = 0; i < n_samples; ++i){
+        for(int c = 0; c < n_clusters; ++c){
+            T product = 0;
+            for(int d = 0; d < n_dims; ++d) product += data[i+d*stride] * cluster[c+d*cluster_stride];
+            const T value = offset[c] + scale[c] * product;
+            if(value < ranking.best[i]){
+                ranking.third[i] = ranking.second[i];
+                ranking.second[i] = ranking.best[i];
+                ranking.k_second[i] = ranking.k_best[i];
+                ranking.best[i] = value;
+                ranking.k_best[i] = c + cluster_offset;
+            } else if(value < ranking.second[i]){
+                ranking.third[i] = ranking.second[i];
+                ranking.second[i] = value;
+                ranking.k_second[i] = c + cluster_offset;
+            } else if(value < ranking.third[i]) ranking.third[i] = value;
+        }
+    }
+}
+
+/**
+ * Scalar reference of filter
+*/
+template<typename T>
+inline int filterScalar(const T* bound, const T* offset, const T* floor, int n, T scale, T threshold, int* candidates, T& min_rest){
+    int n_candidates = 0;
+    for(int c = 0; c < n; ++c){
+        const T lower = bound[c] * scale - offset[c];
+        const bool keep = threshold > (floor[c] < lower ? lower : floor[c]);
+        candidates[n_candidates] = c;
+        n_candidates += keep;
+        const T reflected = 2 * floor[c] * scale - threshold;
+        const T rest = lower < reflected ? reflected : lower;
+        if(!keep && rest < min_rest) min_rest = rest;
+    }
+    return n_candidates;
+}
+
+/**
+ * Scalar reference of assignTwo: assignScalar that also keeps the second smallest distance
+*/
+template<KernelEnum Kernel, int Dims, typename T>
+inline void assignTwoScalar(const T* data, int stride, int n_samples,
+        const T* cluster, int cluster_stride, int n_dims, int n_clusters,
+        int* labels, T* min_dist, T* second_dist){
+    if(Dims) n_dims = Dims;
+    for(int i = 0; i < n_samples; ++i){
+        T best = std::numeric_limits<T>::max();
+        T second = std::numeric_limits<T>::max();
+        int k_index = 0;
+        for(int c = 0; c < n_clusters; ++c){
+            T acc = 0;
+            for(int d = 0; d < n_dims; ++d){
+                T diff = data[i+d*stride] - cluster[c+d*cluster_stride];
+                if(Kernel == L1_KERNEL) acc += (diff < 0 ? -diff : diff);
+                else acc += diff * diff;
+            }
+            if(acc < best){
+                second = best;
+                best = acc;
+                k_index = c;
+            } else if(acc < second) second = acc;
+        }
+        labels[i] = k_index;
+        min_dist[i] = best;
+        second_dist[i] = second;
+    }
+}
+
+#ifdef SIMD_KERNELS_ENABLED
+
+template<typename T, int W>
+struct vec {
+    typedef T type __attribute__((vector_size(W*sizeof(T))));
+    // same width integer vector for the sign mask
+    typedef std::conditional_t<sizeof(T) == 4, int32_t, int64_t> int_t;
+    typedef int_t int_type __attribute__((vector_size(W*sizeof(T))));
+};
+
+// whether a lane of v is not all zero bits
+template<typename V>
+__attribute__((always_inline)) inline bool anyLane(const V& v){
+    uint64_t words[sizeof(V)/sizeof(uint64_t)];
+    std::memcpy(words, &v, sizeof(V));
+    uint64_t any = 0;
+    for(size_t w = 0; w < sizeof(V)/sizeof(uint64_t); ++w) any |= words[w];
+    return any;
+}
+
+/**
+ * Generic body: W samples per iteration. Never called directly, it gets
+ * inlined in the ISA specific wrappers below which decide the generated instructions.
+ * Centroid indices are tracked in a T vector (exact up to 2^24 clusters with floats).
+ * With a compile-time number of features the W samples stay in Dims registers
+ * while every centroid is streamed past them (fully unrolled feature loop).
+*/
+template<KernelEnum Kernel, int Dims, bool Update, typename T, int W>
+__attribute__((always_inline)) inline void assignVector(const T* data, int stride, int n_samples,
+        const T* cluster, int cluster_stride, int n_dims, int n_clusters, int cluster_offset,
+        int* labels, T* min_dist){
+    using V = typename vec<T, W>::type;
+    using IV = typename vec<T, W>::int_type;
+    const V zero = {};
+    // every bit but the sign bit
+    const IV abs_mask = IV{} + std::numeric_limits<typename vec<T, W>::int_t>::max();
+
+    int i = 0;
+    for(; i+W <= n_samples; i += W){
+        V best = zero + std::numeric_limits<T>::max();
+        V k_index = zero;
+        if constexpr(Update){
+            std::memcpy(&best, min_dist+i, sizeof(V));
+            for(int l = 0; l < W; ++l) k_index[l] = static_cast<T>(labels[i+l]);
+        }
+        if constexpr(Dims > 0){
+            V x[Dims];
+            for(int d = 0; d < Dims; ++d) std::memcpy(&x[d], data+i+d*stride, sizeof(V));
+            for(int c = 0; c < n_clusters; ++c){
+                V acc = zero;
+                for(int d = 0; d < Dims; ++d){
+                    V diff = x[d] - cluster[c+d*cluster_stride];
+                    if(Kernel == L1_KERNEL) acc += (V)((IV)diff & abs_mask);
+                    else acc += diff * diff;
+                }
+                auto closer = acc < best;
+                best = closer ? acc : best;
+                k_index = closer ? zero + static_cast<T>(c + cluster_offset) : k_index;
+            }
+        } else {
+            // 4 centroids per pass: each samples vector loaded once for all of them
+            int c = 0;
+            for(; c+4 <= n_clusters; c += 4){
+                V acc[4] = { zero, zero, zero, zero };
+                for(int d = 0; d < n_dims; ++d){
+                    V x;
+                    std::memcpy(&x, data+i+d*stride, sizeof(V));
+                    const T* coords = cluster+c+d*cluster_stride;
+                    for(int n = 0; n < 4; ++n){
+                        V diff = x - coords[n];
+                        if(Kernel == L1_KERNEL) acc[n] += (V)((IV)diff & abs_mask);
+                        else acc[n] += diff * diff;
+                    }
+                }
+                // same order as one centroid at a time: lowest index kept on ties
+                for(int n = 0; n < 4; ++n){
+                    auto closer = acc[n] < best;
+                    best = closer ? acc[n] : best;
+                    k_index = closer ? zero + static_cast<T>(c + n + cluster_offset) : k_index;
+                }
+            }
+            for(; c < n_clusters; ++c){
+                V acc = zero;
+                for(int d = 0; d < n_dims; ++d){
+                    V x;
+                    std::memcpy(&x, data+i+d*stride, sizeof(V));
+                    V diff = x - cluster[c+d*cluster_stride];
+                    if(Kernel == L1_KERNEL) acc += (V)((IV)diff & abs_mask);
+                    else acc += diff * diff;
+                }
+                auto closer = acc < best;
+                best = closer ? acc : best;
+                k_index = closer ? zero + static_cast<T>(c + cluster_offset) : k_index;
+            }
+        }
+        for(int l = 0; l < W; ++l){
+            labels[i+l] = static_cast<int>(k_index[l]);
+            min_dist[i+l] = best[l];
+        }
+    }
+    assignScalar<Kernel, Dims, Update>(data+i, stride, n_samples-i, cluster, cluster_stride, n_dims, n_clusters, cluster_offset, labels+i, min_dist+i);
+}
+
+/**
+ * Generic distances body: 4 vectors of samples per pass so that their 4 independent
+ * accumulation chains hide the add latency (a single point leaves nothing else to
+ * interleave), then one vector at a time. Distances are stored as is, no argmin.
+*/
+template<KernelEnum Kernel, int Dims, typename T, int W>
+__attribute__((always_inline)) inline void distancesVector(const T* data, int stride, int n_samples,
+        const T* point, int point_stride, int n_dims, T* dist){
+    using V = typename vec<T, W>::type;
+    using IV = typename vec<T, W>::int_type;
+    const V zero = {};
+    const IV abs_mask = IV{} + std::numeric_limits<typename vec<T, W>::int_t>::max();
+    if(Dims) n_dims = Dims;
+
+    int i = 0;
+    for(; i+4*W <= n_samples; i += 4*W){
+        V acc[4] = { zero, zero, zero, zero };
+        for(int d = 0; d < n_dims; ++d){
+            const T coord = point[d*point_stride];
+            for(int h = 0; h < 4; ++h){
+                V x;
+                std::memcpy(&x, data+i+h*W+d*stride, sizeof(V));
+                V diff = x - coord;
+                if(Kernel == L1_KERNEL) acc[h] += (V)((IV)diff & abs_mask);
+                else acc[h] += diff * diff;
+            }
+        }
+        std::memcpy(dist+i, acc, sizeof(acc));
+    }
+    for(; i+W <= n_samples; i += W){
+        V acc = zero;
+        for(int d = 0; d < n_dims; ++d){
+            V x;
+            std::memcpy(&x, data+i+d*stride, sizeof(V));
+            V diff = x - point[d*point_stride];
+            if(Kernel == L1_KERNEL) acc += (V)((IV)diff & abs_mask);
+            else acc += diff * diff;
+        }
+        std::memcpy(dist+i, &acc, sizeof(V));
+    }
+    distancesScalar<Kernel, Dims>(data+i, stride, n_samples-i, point, point_stride, n_dims, dist+i);
+}
+
+/**
+ * Generic assignTwo body: assignVector that also keeps the second smallest distance,
+ * min(second, max(best, acc)) (no compare mask shared by two selects).
+*/
+template<KernelEnum Kernel, int Dims, typename T, int W>
+__attribute__((always_inline)) inline void assignTwoVector(const T* data, int stride, int n_samples,
+        const T* cluster, int cluster_stride, int n_dims, int n_clusters,
+        int* labels, T* min_dist, T* second_dist){
+    using V = typename vec<T, W>::type;
+    using IV = typename vec<T, W>::int_type;
+    const V zero = {};
+    const IV abs_mask = IV{} + std::numeric_limits<typename vec<T, W>::int_t>::max();
+
+    int i = 0;
+    for(; i+W <= n_samples; i += W){
+        V best = zero + std::numeric_limits<T>::max();
+        V second = best;
+        V k_index = zero;
+        auto rank = [&](const V& acc, int c){
+            const V demoted = acc < best ? best : acc;
+            second = demoted < second ? demoted : second;
+            k_index = acc < best ? zero + static_cast<T>(c) : k_index;
+            best = acc < best ? acc : best;
+        };
+        if constexpr(Dims > 0){
+            V x[Dims];
+            for(int d = 0; d < Dims; ++d) std::memcpy(&x[d], data+i+d*stride, sizeof(V));
+            for(int c = 0; c < n_clusters; ++c){
+                V acc = zero;
+                for(int d = 0; d < Dims; ++d){
+                    V diff = x[d] - cluster[c+d*cluster_stride];
+                    if(Kernel == L1_KERNEL) acc += (V)((IV)diff & abs_mask);
+                    else acc += diff * diff;
+                }
+                rank(acc, c);
+            }
+        } else {
+            // 4 centroids per pass as in assignVector
+            int c = 0;
+            for(; c+4 <= n_clusters; c += 4){
+                V acc[4] = { zero, zero, zero, zero };
+                for(int d = 0; d < n_dims; ++d){
+                    V x;
+                    std::memcpy(&x, data+i+d*stride, sizeof(V));
+                    const T* coords = cluster+c+d*cluster_stride;
+                    for(int n = 0; n < 4; ++n){
+                        V diff = x - coords[n];
+                        if(Kernel == L1_KERNEL) acc[n] += (V)((IV)diff & abs_mask);
+                        else acc[n] += diff * diff;
+                    }
+                }
+                for(int n = 0; n < 4; ++n) rank(acc[n], c + n);
+            }
+            for(; c < n_clusters; ++c){
+                V acc = zero;
+                for(int d = 0; d < n_dims; ++d){
+                    V x;
+                    std::memcpy(&x, data+i+d*stride, sizeof(V));
+                    V diff = x - cluster[c+d*cluster_stride];
+                    if(Kernel == L1_KERNEL) acc += (V)((IV)diff & abs_mask);
+                    else acc += diff * diff;
+                }
+                rank(acc, c);
+            }
+        }
+        for(int l = 0; l < W; ++l) labels[i+l] = static_cast<int>(k_index[l]);
+        std::memcpy(min_dist+i, &best, sizeof(V));
+        std::memcpy(second_dist+i, &second, sizeof(V));
+    }
+    assignTwoScalar<Kernel, Dims>(data+i, stride, n_samples-i, cluster, cluster_stride, n_dims, n_clusters,
+                                  labels+i, min_dist+i, second_dist+i);
+}
+
+/**
+ * Generic filter body: W bounds per iteration, the indices of a vector are only
+ * written out when one of its lanes is kept (few candidates are expected).
+*/
+template<typename T, int W>
+__attribute__((always_inline)) inline int filterVector(const T* bound, const T* offset, const T* floor, int n, T scale, T threshold,
+        int* candidates, T& min_rest){
+    using V = typename vec<T, W>::type;
+    const V zero = {};
+    const V one = zero + 1;
+    const V limit = zero + threshold;
+    const V none = zero + std::numeric_limits<T>::max();
+    V rest = zero + min_rest;
+    int n_candidates = 0;
+    int c = 0;
+    for(; c+W <= n; c += W){
+        V b, o, f;
+        std::memcpy(&b, bound+c, sizeof(V));
+        std::memcpy(&o, offset+c, sizeof(V));
+        std::memcpy(&f, floor+c, sizeof(V));
+        const V lower = b * scale - o;
+        const V max_lower = f < lower ? lower : f;
+        const V kept = max_lower < limit ? one : zero;
+        const V reflected = 2 * f * scale - limit;
+        const V other = lower < reflected ? reflected : lower;
+        // own comparison: a mask shared by two selects is turned into a vector,
+        // which is done lane by lane with avx512f alone
+        const V left = limit > max_lower ? none : other;
+        rest = left < rest ? left : rest;
+        if(!anyLane(kept)) continue;
+        T lanes[W];
+        std::memcpy(lanes, &kept, sizeof(V));
+        for(int l = 0; l < W; ++l){
+            candidates[n_candidates] = c + l;
+            n_candidates += lanes[l] != 0;
+        }
+    }
+    for(int l = 0; l < W; ++l) min_rest = rest[l] < min_rest ? rest[l] : min_rest;
+    int* tail = candidates + n_candidates;
+    const int n_tail = filterScalar(bound+c, offset+c, floor+c, n-c, scale, threshold, tail, min_rest);
+    for(int m = 0; m < n_tail; ++m) tail[m] += c;
+    return n_candidates + n_tail;
+}
+
+/**
+ * Generic gemmArgmin body: the x.c products of H W samples x 4 centroids are accumulated
+ * in 4 H registers over the whole feature loop (H loads and 4 broadcasts per 4 H
+ * multiply-adds), then turned into epilogue values ranked with vector selects. No
+ * products are stored.
+*/
+template<typename T, int W, int H>
+__attribute__((always_inline)) inline void gemmArgminVector(const T* data, int stride, int n_samples, const T* cluster, int cluster_stride,
+        int n_dims, int n_clusters, int cluster_offset, const T* offset, const T* scale, GemmRanking<T> ranking){
+    using V = typename vec<T, W>::type;
+    const V zero = {};
+
+    int i = 0;
+    for(; i+H*W <= n_samples; i += H*W){
+        V best[H], second[H], third[H], k_best[H], k_second[H];
+        for(int h = 0; h < H; ++h){
+            std::memcpy(&best[h], ranking.best+i+h*W, sizeof(V));
+            std::memcpy(&second[h], ranking.second+i+h*W, sizeof(V));
+            std::memcpy(&third[h], ranking.third+i+h*W, sizeof(V));
+            for(int l = 0; l < W; ++l){
+                k_best[h][l] = static_cast<T>(ranking.k_best[i+h*W+l]);
+                k_second[h][l] = static_cast<T>(ranking.k_second[i+h*W+l]);
+            }
+        }
+        auto rank = [&](int h, const V& value, T index){
+            auto first_closer = value < best[h];
+            auto second_closer = value < second[h];
+            third[h] = second_closer ? second[h] : (value < third[h] ? value : third[h]);
+            second[h] = first_closer ? best[h] : (second_closer ? value : second[h]);
+            k_second[h] = first_closer ? k_best[h] : (second_closer ? zero + index : k_second[h]);
+            best[h] = first_closer ? value : best[h];
+            k_best[h] = first_closer ? zero + index : k_best[h];
+        };
+        int c = 0;
+        for(; c+4 <= n_clusters; c += 4){
+            V acc[H][4];
+            for(int h = 0; h < H; ++h){
+                for(int n = 0; n < 4; ++n) acc[h][n] = zero;
+            }
+            for(int d = 0; d < n_dims; ++d){
+                V x[H];
+                for(int h = 0; h < H; ++h) std::memcpy(&x[h], data+i+h*W+d*stride, sizeof(V));
+                const T* coords = cluster+c+d*cluster_stride;
+                for(int n = 0; n < 4; ++n){
+                    for(int h = 0; h < H; ++h) acc[h][n] += x[h] * coords[n];
+                }
+            }
+            // same order as one centroid at a time: lowest index kept on ties
+            for(int n = 0; n < 4; ++n){
+                for(int h = 0; h < H; ++h) rank(h, offset[c+n] + scale[c+n] * acc[h][n], static_cast<T>(c + n + cluster_offset));
+            }
+        }
+        for(; c < n_clusters; ++c){
+            V acc[H];
+            for(int h = 0; h < H; ++h) acc[h] = zero;
+            for(int d = 0; d < n_dims; ++d){
+                for(int h = 0; h < H; ++h){
+                    V x;
+                    std::memcpy(&x, data+i+h*W+d*stride, sizeof(V));
+                    acc[h] += x * cluster[c+d*cluster_stride];
+                }
+            }
+            for(int h = 0; h < H; ++h) rank(h, offset[c] + scale[c] * acc[h], static_cast<T>(c + cluster_offset));
+        }
+        for(int h = 0; h < H; ++h){
+            std::memcpy(ranking.best+i+h*W, &best[h], sizeof(V));
+            std::memcpy(ranking.second+i+h*W, &second[h], sizeof(V));
+            std::memcpy(ranking.third+i+h*W, &third[h], sizeof(V));
+            for(int l = 0; l < W; ++l){
+                ranking.k_best[i+h*W+l] = static_cast<int>(k_best[h][l]);
+                ranking.k_second[i+h*W+l] = static_cast<int>(k_second[h][l]);
+            }
+        }
+    }
+    GemmRanking<T> rest{ ranking.best+i, ranking.second+i, ranking.third+i, ranking.k_best+i, ranking.k_second+i };
+    gemmArgminScalar(data+i, stride, n_samples-i, cluster, cluster_stride, n_dims, n_clusters, cluster_offset, offset, scale, rest);
+}
+
+template<typename T>
+__attribute__((target("sse4.2"))) void gemmArgminSSE42(const T* data, int stride, int n_samples, const T* cluster, int cluster_stride,
+        int n_dims, int n_clusters, int cluster_offset, const T* offset, const T* scale, GemmRanking<T> ranking){
+    gemmArgminVector<T, 16/sizeof(T), 2>(data, stride, n_samples, cluster, cluster_stride, n_dims, n_clusters, cluster_offset, offset, scale, ranking);
+}
+
+// AVX2/AVX-512: multiply-adds contracted to FMA (off by default in ISO C++ mode)
+template<typename T>
+__attribute__((target("avx2,fma"), optimize("fp-contract=fast"))) void gemmArgminAVX2(const T* data, int stride, int n_samples,
+        const T* cluster, int cluster_stride, int n_dims, int n_clusters, int cluster_offset, const T* offset, const T* scale, GemmRanking<T> ranking){
+    gemmArgminVector<T, 32/sizeof(T), 2>(data, stride, n_samples, cluster, cluster_stride, n_dims, n_clusters, cluster_offset, offset, scale, ranking);
+}
+
+template<typename T>
+__attribute__((target("avx512f"), optimize("fp-contract=fast"))) void gemmArgminAVX512(const T* data, int stride, int n_samples,
+        const T* cluster, int cluster_stride, int n_dims, int n_clusters, int cluster_offset, const T* offset, const T* scale, GemmRanking<T> ranking){
+    gemmArgminVector<T, 64/sizeof(T), 2>(data, stride, n_samples, cluster, cluster_stride, n_dims, n_clusters, cluster_offset, offset, scale, ranking);
+}
+
+template<KernelEnum Kernel, int Dims, bool Update, typename T>
+__attribute__((target("sse4.2"))) void assignSSE42(const T* data, int stride, int n_samples,
+        const T* cluster, int cluster_stride, int n_dims, int n_clusters, int cluster_offset, int* labels, T* min_dist){
+    assignVector<Kernel, Dims, Update, T, 16/sizeof(T)>(data, stride, n_samples, cluster, cluster_stride, n_dims, n_clusters, cluster_offset, labels, min_dist);
+}
+
+template<KernelEnum Kernel, int Dims, bool Update, typename T>
+__attribute__((target("avx2"))) void assignAVX2(const T* data, int stride, int n_samples,
+        const T* cluster, int cluster_stride, int n_dims, int n_clusters, int cluster_offset, int* labels, T* min_dist){
+    assignVector<Kernel, Dims, Update, T, 32/sizeof(T)>(data, stride, n_samples, cluster, cluster_stride, n_dims, n_clusters, cluster_offset, labels, min_dist);
+}
+
+template<KernelEnum Kernel, int Dims, bool Update, typename T>
+__attribute__((target("avx512f"))) void assignAVX512(const T* data, int stride, int n_samples,
+        const T* cluster, int cluster_stride, int n_dims, int n_clusters, int cluster_offset, int* labels, T* min_dist){
+    assignVector<Kernel, Dims, Update, T, 64/sizeof(T)>(data, stride, n_samples, cluster, cluster_stride, n_dims, n_clusters, cluster_offset, labels, min_dist);
+}
+
+template<KernelEnum Kernel, int Dims, typename T>
+__attribute__((target("sse4.2"))) void distancesSSE42(const T* data, int stride, int n_samples,
+        const T* point, int point_stride, int n_dims, T* dist){
+    distancesVector<Kernel, Dims, T, 16/sizeof(T)>(data, stride, n_samples, point, point_stride, n_dims, dist);
+}
+
+template<KernelEnum Kernel, int Dims, typename T>
+__attribute__((target("avx2"))) void distancesAVX2(const T* data, int stride, int n_samples,
+        const T* point, int point_stride, int n_dims, T* dist){
+    distancesVector<Kernel, Dims, T, 32/sizeof(T)>(data, stride, n_samples, point, point_stride, n_dims, dist);
+}
+
+template<KernelEnum Kernel, int Dims, typename T>
+__attribute__((target("avx512f"))) void distancesAVX512(const T* data, int stride, int n_samples,
+        const T* point, int point_stride, int n_dims, T* dist){
+    distancesVector<Kernel, Dims, T, 64/sizeof(T)>(data, stride, n_samples, point, point_stride, n_dims, dist);
+}
+
+template<typename T>
+__attribute__((target("sse4.2"))) int filterSSE42(const T* bound, const T* offset, const T* floor, int n, T scale, T threshold,
+        int* candidates, T& min_rest){
+    return filterVector<T, 16/sizeof(T)>(bound, offset, floor, n, scale, threshold, candidates, min_rest);
+}
+
+template<typename T>
+__attribute__((target("avx2"))) int filterAVX2(const T* bound, const T* offset, const T* floor, int n, T scale, T threshold,
+        int* candidates, T& min_rest){
+    return filterVector<T, 32/sizeof(T)>(bound, offset, floor, n, scale, threshold, candidates, min_rest);
+}
+
+template<typename T>
+__attribute__((target("avx512f"))) int filterAVX512(const T* bound, const T* offset, const T* floor, int n, T scale, T threshold,
+        int* candidates, T& min_rest){
+    return filterVector<T, 64/sizeof(T)>(bound, offset, floor, n, scale, threshold, candidates, min_rest);
+}
+
+template<KernelEnum Kernel, int Dims, typename T>
+__attribute__((target("sse4.2"))) void assignTwoSSE42(const T* data, int stride, int n_samples,
+        const T* cluster, int cluster_stride, int n_dims, int n_clusters, int* labels, T* min_dist, T* second_dist){
+    assignTwoVector<Kernel, Dims, T, 16/sizeof(T)>(data, stride, n_samples, cluster, cluster_stride, n_dims, n_clusters, labels, min_dist, second_dist);
+}
+
+template<KernelEnum Kernel, int Dims, typename T>
+__attribute__((target("avx2"))) void assignTwoAVX2(const T* data, int stride, int n_samples,
+        const T* cluster, int cluster_stride, int n_dims, int n_clusters, int* labels, T* min_dist, T* second_dist){
+    assignTwoVector<Kernel, Dims, T, 32/sizeof(T)>(data, stride, n_samples, cluster, cluster_stride, n_dims, n_clusters, labels, min_dist, second_dist);
+}
+
+template<KernelEnum Kernel, int Dims, typename T>
+__attribute__((target("avx512f"))) void assignTwoAVX512(const T* data, int stride, int n_samples,
+        const T* cluster, int cluster_stride, int n_dims, int n_clusters, int* labels, T* min_dist, T* second_dist){
+    assignTwoVector<Kernel, Dims, T, 64/sizeof(T)>(data, stride, n_samples, cluster, cluster_stride, n_dims, n_clusters, labels, min_dist, second_dist);
+}
+
+#endif
+
+/**
+ * Dispatches to the widest kernel supported by the CPU.
+*/
+template<KernelEnum Kernel, int Dims, bool Update, typename T>
+inline void dispatch(const T* data, int stride, int n_samples,
+        const T* cluster, int cluster_stride, int n_dims, int n_clusters, int cluster_offset,
+        int* labels, T* min_dist){
+    static_assert(std::is_same<T, float>::value || std::is_same<T, double>::value, "simd kernels: float or double only");
+#ifdef SIMD_KERNELS_ENABLED
+    switch(detectISA()){
+        case AVX512:
+            assignAVX512<Kernel, Dims, Update>(data, stride, n_samples, cluster, cluster_stride, n_dims, n_clusters, cluster_offset, labels, min_dist);
+            return;
+        case AVX2:
+            assignAVX2<Kernel, Dims, Update>(data, stride, n_samples, cluster, cluster_stride, n_dims, n_clusters, cluster_offset, labels, min_dist);
+            return;
+        case SSE42:
+            assignSSE42<Kernel, Dims, Update>(data, stride, n_samples, cluster, cluster_stride, n_dims, n_clusters, cluster_offset, labels, min_dist);
+            return;
+        default:
+            break;
+    }
+#endif
+    assignScalar<Kernel, Dims, Update>(data, stride, n_samples, cluster, cluster_stride, n_dims, n_clusters, cluster_offset, labels, min_dist);
+}
+
+/**
+ * Closest centroid of each sample (labels) and its distance (min_dist).
+ * T: float or double
+ * Dims: compile-time number of features, 0 if only known at runtime (n_dims)
+*/
+template<KernelEnum Kernel, int Dims, typename T>
+inline void assign(const T* data, int stride, int n_samples,
+        const T* cluster, int cluster_stride, int n_dims, int n_clusters,
+        int* labels, T* min_dist){
+    dispatch<Kernel, Dims, false>(data, stride, n_samples, cluster, cluster_stride, n_dims, n_clusters, 0, labels, min_dist);
+}
+
+/**
+ * Same as assign for a block of centroids (indices cluster_offset + [0, n_clusters)):
+ * labels/min_dist hold the mapping w.r.t. the previous blocks and are only updated
+ * by strictly closer centroids, so processing the blocks in increasing order gives
+ * the same mapping as assign over all of them.
+*/
+template<KernelEnum Kernel, int Dims, typename T>
+inline void assignBlock(const T* data, int stride, int n_samples,
+        const T* cluster, int cluster_stride, int n_dims, int n_clusters, int cluster_offset,
+        int* labels, T* min_dist){
+    dispatch<Kernel, Dims, true>(data, stride, n_samples, cluster, cluster_stride, n_dims, n_clusters, cluster_offset, labels, min_dist);
+}
+
+/**
+ * Distance between each sample and a single point (feature d at point[d*point_stride]),
+ * e.g. one sample against feature-major centroids. Same values as assign.
+ * T: float or double
+*/
+template<KernelEnum Kernel, int Dims, typename T>
+inline void distances(const T* data, int stride, int n_samples, const T* point, int point_stride, int n_dims, T* dist){
+    static_assert(std::is_same<T, float>::value || std::is_same<T, double>::value, "simd kernels: float or double only");
+#ifdef SIMD_KERNELS_ENABLED
+    switch(detectISA()){
+        case AVX512:
+            distancesAVX512<Kernel, Dims>(data, stride, n_samples, point, point_stride, n_dims, dist);
+            return;
+        case AVX2:
+            distancesAVX2<Kernel, Dims>(data, stride, n_samples, point, point_stride, n_dims, dist);
+            return;
+        case SSE42:
+            distancesSSE42<Kernel, Dims>(data, stride, n_samples, point, point_stride, n_dims, dist);
+            return;
+        default:
+            break;
+    }
+#endif
+    distancesScalar<Kernel, Dims>(data, stride, n_samples, point, point_stride, n_dims, dist);
+}
+
+/**
+ * GEMM engine kernel: ranks the centroids cluster_offset + [0, n_clusters) by
+ * offset[c] + scale[c] * x.c for each of the n_samples samples (feature d of sample i
+ * at data[i+d*stride], centroids NxK with row stride cluster_stride), updating the
+ * ranking left by the previous blocks of centroids (strictly smaller values only).
+ * T: float or double
+*/
+template<typename T>
+inline void gemmArgmin(const T* data, int stride, int n_samples, const T* cluster, int cluster_stride,
+        int n_dims, int n_clusters, int cluster_offset, const T* offset, const T* scale, GemmRanking<T> ranking){
+    static_assert(std::is_same<T, float>::value || std::is_same<T, double>::value, "simd kernels: float or double only");
+#ifdef SIMD_KERNELS_ENABLED
+    switch(detectISA()){
+        case AVX512:
+            gemmArgminAVX512(data, stride, n_samples, cluster, cluster_stride, n_dims, n_clusters, cluster_offset, offset, scale, ranking);
+            return;
+        case AVX2:
+            if(hasFMA()) gemmArgminAVX2(data, stride, n_samples, cluster, cluster_stride, n_dims, n_clusters, cluster_offset, offset, scale, ranking);
+            else gemmArgminSSE42(data, stride, n_samples, cluster, cluster_stride, n_dims, n_clusters, cluster_offset, offset, scale, ranking);
+            return;
+        case SSE42:
+            gemmArgminSSE42(data, stride, n_samples, cluster, cluster_stride, n_dims, n_clusters, cluster_offset, offset, scale, ranking);
+            return;
+        default:
+            break;
+    }
+#endif
+    gemmArgminScalar(data, stride, n_samples, cluster, cluster_stride, n_dims, n_clusters, cluster_offset, offset, scale, ranking);
+}
+
+/**
+ * Bound engines filter: writes the indices c in [0, n) such that
+ *      threshold > max(floor[c], bound[c] * scale - offset[c])
+ * to candidates (increasing order, n ints of room) and returns their number.
+ * min_rest: lowered to the smallest max(bound[c] * scale - offset[c], 2 floor[c] * scale - threshold)
+ * of the other indices (with floor[c] half the distance between c and the point of the
+ * threshold distance, a lower bound of the distance to c by the triangle inequality)
+ * T: float or double
+*/
+template<typename T>
+inline int filter(const T* bound, const T* offset, const T* floor, int n, T scale, T threshold, int* candidates, T& min_rest){
+    static_assert(std::is_same<T, float>::value || std::is_same<T, double>::value, "simd kernels: float or double only");
+#ifdef SIMD_KERNELS_ENABLED
+    switch(detectISA()){
+        case AVX512:
+            return filterAVX512(bound, offset, floor, n, scale, threshold, candidates, min_rest);
+        case AVX2:
+            return filterAVX2(bound, offset, floor, n, scale, threshold, candidates, min_rest);
+        case SSE42:
+            return filterSSE42(bound, offset, floor, n, scale, threshold, candidates, min_rest);
+        default:
+            break;
+    }
+#endif
+    return filterScalar(bound, offset, floor, n, scale, threshold, candidates, min_rest);
+}
+
+/**
+ * Closest centroid of each sample (labels), its distance (min_dist) and the distance
+ * to the second closest one (second_dist, max value if n_clusters == 1). Same mapping
+ * as assign. T: float or double
+*/
+template<KernelEnum Kernel, int Dims, typename T>
+inline void assignTwo(const T* data, int stride, int n_samples,
+        const T* cluster, int cluster_stride, int n_dims, int n_clusters,
+        int* labels, T* min_dist, T* second_dist){
+    static_assert(std::is_same<T, float>::value || std::is_same<T, double>::value, "simd kernels: float or double only");
+#ifdef SIMD_KERNELS_ENABLED
+    switch(detectISA()){
+        case AVX512:
+            assignTwoAVX512<Kernel, Dims>(data, stride, n_samples, cluster, cluster_stride, n_dims, n_clusters, labels, min_dist, second_dist);
+            return;
+        case AVX2:
+            assignTwoAVX2<Kernel, Dims>(data, stride, n_samples, cluster, cluster_stride, n_dims, n_clusters, labels, min_dist, second_dist);
+            return;
+        case SSE42:
+            assignTwoSSE42<Kernel, Dims>(data, stride, n_samples, cluster, cluster_stride, n_dims, n_clusters, labels, min_dist, second_dist);
+            return;
+        default:
+            break;
+    }
+#endif
+    assignTwoScalar<Kernel, Dims>(data, stride, n_samples, cluster, cluster_stride, n_dims, n_clusters, labels, min_dist, second_dist);
+}
+
+} // namespace simd
@@ -0,0 +1,69 @@
+#pragma once
+
+#include <memory>
+#include <cassert>
+
+#include "Matrix.h"
+
+/**
+ * Memory layout of the training set used by the assignment and update loops
+ *      FEATURE_MAJOR: NxM Matrix, one row per feature (default)
+ *      TILED: TiledMatrix copy (tiles of W samples x N features), see below
+*/
+enum LayoutEnum { FEATURE_MAJOR, TILED };
+
+/**
+ * Tiled (AoSoA) copy of a NxM feature-major matrix. Samples are grouped by
+ * tiles of W consecutive samples and a tile stores its N features one after
+ * the other: feature d of sample i at tile(i/W)[d*W + i%W].
+ * A whole tile (W*N values) is contiguous so a sweep over the samples reads
+ * a single sequential stream instead of N rows M elements apart, while the
+ * W samples of a feature stay contiguous for the vectorized kernels
+ * (a tile is a NxW feature-major block of row stride W).
+ * The last tile is padded with zeros.
+*/
+template<typename T, int W = 16>
+class TiledMatrix {
+public:
+    TiledMatrix(const Matrix<T>& matrix, int num_threads = 1);
+
+    int getRows() const { return _rows; }
+    int getCols() const { return _cols; }
+    int getTilesN() const { return _n_tiles; }
+    /**
+     * number of actual samples of tile t (W except for the last one)
+    */
+    int tileSize(int t) const { return std::min(W, _cols - t*W); }
+
+    const T* tile(int t) const { return _tiles.get() + static_cast<size_t>(t)*W*_rows; }
+    T* tile(int t) { return _tiles.get() + static_cast<size_t>(t)*W*_rows; }
+
+    const T& operator()(int row, int col) const { return tile(col/W)[row*W + col%W]; }
+
+    static constexpr int tileWidth = W;
+
+private:
+    int _rows;
+    int _cols;
+    int _n_tiles;
+    int _n_threads;
+    std::unique_ptr<T[]> _tiles;
+};
+
+template<typename T, int W>
+TiledMatrix<T, W>::TiledMatrix(const Matrix<T>& matrix, int num_threads) :
+        _rows{ matrix.getRows() },
+        _cols{ matrix.getCols() },
+        _n_tiles{ (matrix.getCols() + W - 1) / W },
+        _n_threads{ num_threads },
+        _tiles{ std::make_unique<T[]>(static_cast<size_t>(_n_tiles)*W*_rows) } {
+
+    #pragma omp parallel for num_threads(_n_threads)
+    for(int t = 0; t < _n_tiles; ++t){
+        T* dst = tile(t);
+        const int size = tileSize(t);
+        for(int d = 0; d < _rows; ++d){
+            for(int l = 0; l < W; ++l) dst[d*W+l] = l < size ? matrix(d, t*W+l) : 0;
+        }
+    }
+}
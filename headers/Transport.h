@@ -0,0 +1,227 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <chrono>
+#include <thread>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cstddef>
+#include <algorithm>
+
+#include <poll.h>
+#include <netdb.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/un.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+/**
+ * Communication between the P processes (ranks 0, ..., P-1) of a data-parallel
+ * run, seen as a ring: every rank only talks to the next one (rank+1 mod P) and
+ * the previous one (rank-1 mod P). Other transports (MPI, RDMA, ...) only need
+ * to implement sendRecv.
+*/
+class Transport {
+public:
+    virtual ~Transport() = default;
+
+    virtual int getRank() const = 0;
+    virtual int getSize() const = 0;
+    /**
+     * Sends n_send bytes to the next rank while receiving n_recv bytes from the
+     * previous one (both sides at once: no deadlock whatever the sizes)
+    */
+    virtual void sendRecv(const void* send, size_t n_send, void* recv, size_t n_recv) = 0;
+};
+
+/**
+ *      UNIX_SOCKET: Unix-domain stream sockets, addresses are file paths (one machine)
+ *      TCP_SOCKET: TCP sockets, addresses are "host:port"
+*/
+enum SocketEnum { UNIX_SOCKET, TCP_SOCKET };
+
+/**
+ * Ring of stream sockets: rank r listens on addresses[r], connects to the
+ * address of the next rank and accepts the connection of the previous one.
+ * The ranks may start in any order (connections are retried for timeout_ms).
+ * Errors (address in use, peer gone, ...) abort the process with a message:
+ * the other ranks can't go on without it.
+*/
+class SocketTransport : public Transport {
+public:
+    SocketTransport(int rank, const std::vector<std::string>& addresses, SocketEnum socket=UNIX_SOCKET, int timeout_ms=60000);
+    ~SocketTransport() override;
+    SocketTransport(const SocketTransport&) = delete;
+    SocketTransport& operator=(const SocketTransport&) = delete;
+
+    int getRank() const override { return _rank; }
+    int getSize() const override { return _size; }
+    void sendRecv(const void* send, size_t n_send, void* recv, size_t n_recv) override;
+
+private:
+    static void check(bool ok, const char* what){
+        if(ok) return;
+        std::perror(what);
+        std::abort();
+    }
+    /**
+     * socket address of a "path" (UNIX_SOCKET) or "host:port" (TCP_SOCKET)
+    */
+    socklen_t resolve(const std::string& address, sockaddr_storage& storage) const;
+    int open() const;
+
+    int _rank;
+    int _size;
+    SocketEnum _socket;
+    std::string _address;
+    int _listen_fd = -1;
+    // connections to the next and from the previous rank
+    int _next_fd = -1;
+    int _prev_fd = -1;
+};
+
+inline SocketTransport::SocketTransport(int rank, const std::vector<std::string>& addresses, SocketEnum socket, int timeout_ms) :
+        _rank{ rank },
+        _size{ static_cast<int>(addresses.size()) },
+        _socket{ socket } {
+
+    if(_size < 2) return;
+    _address = addresses[_rank];
+    sockaddr_storage storage;
+    // listens first: the previous rank may connect before this one accepts
+    socklen_t length = resolve(_address, storage);
+    _listen_fd = open();
+    if(_socket == UNIX_SOCKET) ::unlink(_address.c_str());
+    else {
+        int reuse = 1;
+        ::setsockopt(_listen_fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+    }
+    check(::bind(_listen_fd, reinterpret_cast<sockaddr*>(&storage), length) == 0, "SocketTransport: bind");
+    check(::listen(_listen_fd, 1) == 0, "SocketTransport: listen");
+
+    // the next rank may not be listening yet
+    length = resolve(addresses[(_rank + 1) % _size], storage);
+    const auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout_ms);
+    for(;;){
+        _next_fd = open();
+        if(::connect(_next_fd, reinterpret_cast<sockaddr*>(&storage), length) == 0) break;
+        ::close(_next_fd);
+        check(std::chrono::steady_clock::now() < deadline, "SocketTransport: connect");
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    _prev_fd = ::accept(_listen_fd, nullptr, nullptr);
+    check(_prev_fd >= 0, "SocketTransport: accept");
+
+    for(int fd : { _next_fd, _prev_fd }){
+        if(_socket == TCP_SOCKET){
+            // small messages, latency bound
+            int no_delay = 1;
+            ::setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &no_delay, sizeof(no_delay));
+        }
+        ::fcntl(fd, F_SETFL, ::fcntl(fd, F_GETFL) | O_NONBLOCK);
+    }
+}
+
+inline SocketTransport::~SocketTransport(){
+    for(int fd : { _next_fd, _prev_fd, _listen_fd }){
+        if(fd >= 0) ::close(fd);
+    }
+    if(_listen_fd >= 0 && _socket == UNIX_SOCKET) ::unlink(_address.c_str());
+}
+
+inline socklen_t SocketTransport::resolve(const std::string& address, sockaddr_storage& storage) const {
+    std::memset(&storage, 0, sizeof(storage));
+    if(_socket == UNIX_SOCKET){
+        sockaddr_un* unix_address = reinterpret_cast<sockaddr_un*>(&storage);
+        check(address.size() < sizeof(unix_address->sun_path), "SocketTransport: path too long");
+        unix_address->sun_family = AF_UNIX;
+        std::copy(address.begin(), address.end(), unix_address->sun_path);
+        return sizeof(sockaddr_un);
+    }
+    const size_t colon = address.rfind(':');
+    check(colon != std::string::npos, "SocketTransport: host:port expected");
+    addrinfo hints;
+    std::memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    addrinfo* info = nullptr;
+    check(::getaddrinfo(address.substr(0, colon).c_str(), address.substr(colon+1).c_str(), &hints, &info) == 0 && info,
+          "SocketTransport: getaddrinfo");
+    const socklen_t length = info->ai_addrlen;
+    std::memcpy(&storage, info->ai_addr, length);
+    ::freeaddrinfo(info);
+    return length;
+}
+
+inline int SocketTransport::open() const {
+    const int fd = ::socket(_socket == UNIX_SOCKET ? AF_UNIX : AF_INET, SOCK_STREAM, 0);
+    check(fd >= 0, "SocketTransport: socket");
+    return fd;
+}
+
+inline void SocketTransport::sendRecv(const void* send, size_t n_send, void* recv, size_t n_recv){
+    const char* send_bytes = static_cast<const char*>(send);
+    char* recv_bytes = static_cast<char*>(recv);
+    size_t sent = 0, received = 0;
+    while(sent < n_send || received < n_recv){
+        pollfd fds[2];
+        int n_fds = 0;
+        if(sent < n_send) fds[n_fds++] = pollfd{ _next_fd, POLLOUT, 0 };
+        if(received < n_recv) fds[n_fds++] = pollfd{ _prev_fd, POLLIN, 0 };
+        check(::poll(fds, n_fds, -1) >= 0, "SocketTransport: poll");
+        for(int f = 0; f < n_fds; ++f){
+            if(!fds[f].revents) continue;
+            if(fds[f].fd == _next_fd){
+                const ssize_t n = ::send(_next_fd, send_bytes + sent, n_send - sent, MSG_NOSIGNAL);
+                check(n >= 0 || errno == EAGAIN || errno == EWOULDBLOCK, "SocketTransport: send");
+                if(n > 0) sent += n;
+            } else {
+                const ssize_t n = ::recv(_prev_fd, recv_bytes + received, n_recv - received, 0);
+                check(n != 0, "SocketTransport: previous rank closed the connection");
+                check(n > 0 || errno == EAGAIN || errno == EWOULDBLOCK, "SocketTransport: recv");
+                if(n > 0) received += n;
+            }
+        }
+    }
+}
+
+/**
+ * Sums the size values of every rank, result on every rank (bit-identical):
+ * ring allreduce, a reduce-scatter then an allgather of P segments, 2 (P-1)
+ * steps each sending size / P values to the next rank. Bandwidth per rank
+ * 2 size (P-1) / P whatever the number of ranks.
+ * scratch: receive buffer, grown to size / P + 1 values if needed (kept by the
+ * caller from one call to the next: no allocation in steady state)
+*/
+template<typename T>
+void ringAllreduce(Transport& transport, T* data, size_t size, std::vector<T>& scratch){
+    const int n_ranks = transport.getSize();
+    if(n_ranks < 2) return;
+    const int rank = transport.getRank();
+    auto segmentBegin = [&](int s){ return size * s / n_ranks; };
+    auto segmentSize = [&](int s){ return segmentBegin(s+1) - segmentBegin(s); };
+    if(scratch.size() < size / n_ranks + 1) scratch.resize(size / n_ranks + 1);
+    T* received = scratch.data();
+
+    // reduce-scatter: after step s, segment rank-s-1 holds the sum of s+2 ranks
+    for(int step = 0; step < n_ranks-1; ++step){
+        const int send_segment = (rank - step + n_ranks) % n_ranks;
+        const int recv_segment = (rank - step - 1 + 2*n_ranks) % n_ranks;
+        transport.sendRecv(data + segmentBegin(send_segment), segmentSize(send_segment) * sizeof(T),
+                           received, segmentSize(recv_segment) * sizeof(T));
+        T* segment = data + segmentBegin(recv_segment);
+        for(size_t n = 0; n < segmentSize(recv_segment); ++n) segment[n] += received[n];
+    }
+    // allgather: segment rank+1 is complete, passed along the ring
+    for(int step = 0; step < n_ranks-1; ++step){
+        const int send_segment = (rank + 1 - step + n_ranks) % n_ranks;
+        const int recv_segment = (rank - step + n_ranks) % n_ranks;
+        transport.sendRecv(data + segmentBegin(send_segment), segmentSize(send_segment) * sizeof(T),
+                           data + segmentBegin(recv_segment), segmentSize(recv_segment) * sizeof(T));
+    }
+}
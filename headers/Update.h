@@ -0,0 +1,108 @@
+#pragma once
+
+#include <cmath>
+#include <cstddef>
+
+#include "Matrix.h"
+#include "Reduction.h"
+#include "Workspace.h"
+
+/**
+ * Mean update step shared by the k-means variants: clusters sums (sums[c+d*K])
+ * and sizes of feature-major samples (feature d of sample i at data[i+d*stride])
+ * given their labels, then centroids moved to the (count weighted) means.
+*/
+namespace update {
+
+/**
+ * Adds the samples [from_i, to_i) to the sums and sizes of their cluster labels[i].
+ * Feature by feature: each sum gets its samples in increasing order.
+*/
+template<typename T>
+void accumulate(const T* data, int stride, int n_dims, int n_clusters, const int* labels, int from_i, int to_i, T* sums, int* counts){
+    for(int d = 0; d < n_dims; ++d){
+        const T* row = data + static_cast<size_t>(d)*stride;
+        T* feature_sums = sums + static_cast<size_t>(d)*n_clusters;
+        for(int i = from_i; i < to_i; ++i) feature_sums[labels[i]] += row[i];
+    }
+    for(int i = from_i; i < to_i; ++i) ++counts[labels[i]];
+}
+
+/**
+ * Pass totals returned by clusterSums (buffers of the workspace)
+*/
+template<typename T>
+struct ClusterSums {
+    T* sums;
+    int* counts;
+    // sum of dist over the samples (0 without dist)
+    double inertia;
+};
+
+/**
+ * Clusters sums and sizes of n_samples samples: one accumulator per part (blocks of
+ * align samples, see headers/Reduction.h) summed with a fixed tree, same values whatever
+ * the number of threads. The buffers are taken from workspace (not reset).
+ * dist (optional): distance of each sample to its centroid, summed in part order
+*/
+template<typename T>
+ClusterSums<T> clusterSums(const T* data, int stride, int n_samples, int n_dims, int n_clusters, const int* labels,
+                           int align, int n_threads, Workspace& workspace, const T* dist = nullptr){
+    const int n_parts = reduction::partsN(n_samples, align, 4*n_clusters);
+    const size_t sums_size = static_cast<size_t>(n_clusters) * n_dims;
+    T* part_sums = workspace.allocZero<T>(n_parts * sums_size);
+    int* part_counts = workspace.allocZero<int>(static_cast<size_t>(n_parts) * n_clusters);
+    double* part_inertia = workspace.allocZero<double>(n_parts);
+
+    #pragma omp parallel for num_threads(n_threads)
+    for(int part = 0; part < n_parts; ++part){
+        const int from_i = reduction::partBegin(part, n_parts, n_samples, align);
+        const int to_i = reduction::partBegin(part+1, n_parts, n_samples, align);
+        accumulate(data, stride, n_dims, n_clusters, labels, from_i, to_i,
+                   part_sums + part*sums_size, part_counts + static_cast<size_t>(part)*n_clusters);
+        if(!dist) continue;
+        double inertia = 0;
+        for(int i = from_i; i < to_i; ++i) inertia += dist[i];
+        part_inertia[part] = inertia;
+    }
+    reduction::treeReduce(part_sums, n_parts, sums_size, n_threads);
+    reduction::treeReduce(part_counts, n_parts, n_clusters, n_threads);
+    double inertia = 0;
+    for(int part = 0; part < n_parts; ++part) inertia += part_inertia[part];
+    return ClusterSums<T>{ part_sums, part_counts, inertia };
+}
+
+/**
+ * Moves every centroid (NxK) with samples to the count weighted mean
+ *      c = (past[c] c + sums_c) / (past[c] + counts[c])
+ * past: weight of the current position (e.g. samples it was already given),
+ * nullptr for the plain mean sums_c / counts[c]. Clusters without samples keep
+ * their position. normalize: the means are projected on the unit sphere
+ * (NORMALIZED_MEAN). Returns the sum of the squared moves before the projection.
+*/
+template<typename T, typename S, typename C, typename P = double>
+double meanUpdate(Matrix<T>& centroids, const S* sums, const C* counts, bool normalize, const P* past = nullptr){
+    const int n_dims = centroids.getRows();
+    const int n_clusters = centroids.getCols();
+    double movement = 0;
+    for(int c = 0; c < n_clusters; ++c){
+        if(!counts[c]) continue;
+        for(int d = 0; d < n_dims; ++d){
+            T& centroid = centroids(d, c);
+            const S& sum = sums[c+static_cast<size_t>(d)*n_clusters];
+            const T mean = past ? static_cast<T>((static_cast<double>(past[c]) * centroid + sum) / (static_cast<double>(past[c]) + counts[c]))
+                                : static_cast<T>(sum / counts[c]);
+            movement += static_cast<double>(mean - centroid) * (mean - centroid);
+            centroid = mean;
+        }
+        if(!normalize) continue;
+        T norm = 0;
+        for(int d = 0; d < n_dims; ++d) norm += centroids(d, c) * centroids(d, c);
+        if(norm <= 0) continue;
+        norm = std::sqrt(norm);
+        for(int d = 0; d < n_dims; ++d) centroids(d, c) /= norm;
+    }
+    return movement;
+}
+
+} // namespace update
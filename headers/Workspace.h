@@ -0,0 +1,83 @@
+#pragma once
+
+#include <memory>
+#include <vector>
+#include <cstddef>
+#include <cstdint>
+#include <algorithm>
+
+/**
+ * Scratch memory reused from one iteration to the next (bump allocator).
+ * Buffers are handed out by alloc<U>(n) (64 bytes aligned, uninitialized) or
+ * allocZero<U>(n) and all released at once by reset().
+ * A request that doesn't fit in the block gets an extra block (buffers already
+ * handed out stay valid) and the next reset() merges every block into a single
+ * one. After the first iteration (or a big enough reserve) the same block
+ * serves every call: no allocation in steady state.
+ * Not thread safe: per-thread buffers are allocated before the parallel regions.
+*/
+class Workspace {
+public:
+    explicit Workspace(size_t bytes = 0){ reserve(bytes); }
+
+    /**
+     * Grows the block to at least bytes. Invalidates the buffers handed out.
+    */
+    void reserve(size_t bytes){
+        if(bytes <= _capacity) return;
+        _block = std::make_unique<unsigned char[]>(bytes + _alignment);
+        _capacity = bytes;
+        _used = 0;
+    }
+
+    /**
+     * Releases every buffer (merging the extra blocks into the main one)
+    */
+    void reset(){
+        if(!_extra.empty()){
+            const size_t bytes = _capacity + _extra_bytes;
+            _extra.clear();
+            _extra_bytes = 0;
+            _capacity = 0;
+            reserve(bytes);
+        }
+        _used = 0;
+    }
+
+    template<typename U>
+    U* alloc(size_t n){
+        const size_t bytes = (n * sizeof(U) + _alignment - 1) / _alignment * _alignment;
+        if(_used + bytes <= _capacity){
+            U* buffer = reinterpret_cast<U*>(aligned(_block.get()) + _used);
+            _used += bytes;
+            return buffer;
+        }
+        _extra.push_back(std::make_unique<unsigned char[]>(bytes + _alignment));
+        _extra_bytes += bytes;
+        return reinterpret_cast<U*>(aligned(_extra.back().get()));
+    }
+
+    template<typename U>
+    U* allocZero(size_t n){
+        U* buffer = alloc<U>(n);
+        std::fill(buffer, buffer + n, U(0));
+        return buffer;
+    }
+
+    size_t getCapacity() const { return _capacity; }
+
+private:
+    static constexpr size_t _alignment = 64;
+
+    static unsigned char* aligned(unsigned char* ptr){
+        const uintptr_t address = reinterpret_cast<uintptr_t>(ptr);
+        return ptr + ((_alignment - address % _alignment) % _alignment);
+    }
+
+    std::unique_ptr<unsigned char[]> _block;
+    size_t _capacity = 0;
+    size_t _used = 0;
+    // blocks allocated since the last reset
+    std::vector<std::unique_ptr<unsigned char[]>> _extra;
+    size_t _extra_bytes = 0;
+};
@@ -112,7 +112,7 @@ double stand_dev_mat(const Matrix<int>& vect, const double& mu){
 	return std::sqrt(1.0/(vect.getCols()-1)*res);
 }
 
-void KMeansBenckmark(const Matrix<float>& DATABASE, int n_centroids, 
+void KMeansBenckmark(std::shared_ptr<const Matrix<float>> DATABASE, int n_centroids, 
 		double *time_arr, double *sd_time_arr, 
 		double *iters_arr, double *sd_iters_arr,
 		double *errors_arr, double *sd_errors_arr,
@@ -124,7 +124,7 @@ void KMeansBenckmark(const Matrix<float>& DATABASE, int n_centroids,
     static Timer<nano_t> timer_inner;
 
     for(int i = 0; i < 7; ++i){
-        KMeans<float> KM(DATABASE, n_centroids, true, 6);
+        KMeans<float, 3> KM(DATABASE, n_centroids, true, 6);
 
         timer_inner.reset();
         KM.run(400, 0.01);
@@ -208,8 +208,10 @@ int main(int argc, char** argv){
 	double errors_arr[size];
 	double sd_errors_arr[size];
 
+    // shared by every KMeans instance of the benchmark (no copy per run)
+    auto SHARED_DATABASE = std::make_shared<const Matrix<float>>(DATABASE);
     for(int n = 0; n < size; ++n){
-        KMeansBenckmark(DATABASE, 2+n, time_arr, sd_time_arr, iters_arr, sd_iters_arr, errors_arr, sd_errors_arr, n);
+        KMeansBenckmark(SHARED_DATABASE, 2+n, time_arr, sd_time_arr, iters_arr, sd_iters_arr, errors_arr, sd_errors_arr, n);
     }
 	std::cout << "\ncluster_size = [";
 	for(int n = 0; n < size; ++n){